@@ -0,0 +1,302 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <fuse.h>
+#include <fuse_log.h>
+
+#include "arena.h"
+#include "fs.h"
+#include "route.h"
+
+/*
+ * Drive the handlers directly, without the kernel or libfuse's request
+ * loop, and report throughput and latency percentiles for each kind of
+ * operation.  Writes store back the bytes just read from the same
+ * offset, so the image is left unchanged.
+ *
+ * Usage: fmapfs-bench <image_path> [iterations]
+ */
+
+#define BENCH_CHUNK 4096
+
+struct bench_file {
+	const char *path;
+	struct fuse_file_info fi;
+	size_t size;
+};
+
+struct bench {
+	struct fmapfs_state *state;
+
+	const char **paths;
+	size_t n_paths;
+
+	/* Region raw files, and generated (version, flag, string) files */
+	struct bench_file *raw;
+	size_t n_raw;
+	struct bench_file *generated;
+	size_t n_generated;
+
+	struct fuse_file_info areas_dir;
+	size_t dir_entries;
+
+	char buf[BENCH_CHUNK];
+};
+
+struct bench_case {
+	const char *name;
+	/* Optional, untimed setup for iteration i */
+	int (*prepare)(struct bench *b, size_t i);
+	int (*run)(struct bench *b, size_t i);
+};
+
+static void bench_log(enum fuse_log_level level, const char *fmt, va_list ap)
+{
+	if (level > FUSE_LOG_ERR)
+		return;
+
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+}
+
+static off_t chunk_offset(struct bench_file *f, size_t i)
+{
+	size_t n_chunks = (f->size + BENCH_CHUNK - 1) / BENCH_CHUNK;
+
+	return n_chunks ? (off_t)(i % n_chunks) * BENCH_CHUNK : 0;
+}
+
+static int bench_getattr(struct bench *b, size_t i)
+{
+	struct stat st;
+
+	return fmapfs_image_getattr(b->state, b->paths[i % b->n_paths], &st);
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *st,
+			off_t off, enum fuse_fill_dir_flags flags)
+{
+	struct bench *b = buf;
+
+	b->dir_entries++;
+	return 0;
+}
+
+static int bench_readdir(struct bench *b, size_t i)
+{
+	return fmapfs_ops.readdir(NULL, b, count_filler, 0, &b->areas_dir, 0);
+}
+
+static int bench_read_raw(struct bench *b, size_t i)
+{
+	struct bench_file *f = &b->raw[i % b->n_raw];
+
+	return fmapfs_ops.read(NULL, b->buf, sizeof(b->buf),
+			       chunk_offset(f, i / b->n_raw), &f->fi);
+}
+
+static int bench_read_generated(struct bench *b, size_t i)
+{
+	struct bench_file *f = &b->generated[i % b->n_generated];
+
+	return fmapfs_ops.read(NULL, b->buf, sizeof(b->buf), 0, &f->fi);
+}
+
+static int bench_write_raw(struct bench *b, size_t i)
+{
+	struct bench_file *f = &b->raw[i % b->n_raw];
+	off_t offset = chunk_offset(f, i / b->n_raw);
+	size_t n_bytes = f->size - offset;
+
+	if (n_bytes > sizeof(b->buf))
+		n_bytes = sizeof(b->buf);
+
+	return fmapfs_ops.write(NULL, b->buf, n_bytes, offset, &f->fi);
+}
+
+static const struct bench_case cases[] = {
+	{ "getattr", NULL, bench_getattr },
+	{ "readdir", NULL, bench_readdir },
+	{ "read_raw", NULL, bench_read_raw },
+	{ "read_generated", NULL, bench_read_generated },
+	{ "write_raw", bench_read_raw, bench_write_raw },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+static int run_case(struct bench *b, const struct bench_case *c,
+		    uint64_t *latencies, size_t iterations)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < iterations; i++) {
+		uint64_t start;
+		int rv;
+
+		if (c->prepare && c->prepare(b, i) < 0)
+			goto fail;
+
+		start = now_ns();
+		rv = c->run(b, i);
+		latencies[i] = now_ns() - start;
+		total += latencies[i];
+
+		if (rv < 0)
+			goto fail;
+	}
+
+	qsort(latencies, iterations, sizeof(*latencies), cmp_u64);
+	printf("%-16s %12.0f %10llu %10llu %10llu %10llu\n", c->name,
+	       iterations / (total / 1e9),
+	       (unsigned long long)latencies[iterations * 50 / 100],
+	       (unsigned long long)latencies[iterations * 90 / 100],
+	       (unsigned long long)latencies[iterations * 99 / 100],
+	       (unsigned long long)latencies[iterations - 1]);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s failed\n", c->name);
+	return -1;
+}
+
+static int open_file(struct bench *b, struct bench_file *f, const char *path)
+{
+	struct stat st;
+
+	f->path = path;
+	f->fi.flags = O_RDWR;
+	if (fmapfs_image_getattr(b->state, path, &st) < 0 ||
+	    fmapfs_image_open(b->state, path, &f->fi) < 0) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return -1;
+	}
+	f->size = st.st_size;
+
+	return 0;
+}
+
+static int bench_setup(struct bench *b)
+{
+	struct fmapfs_state *state = b->state;
+	char path[PATH_MAX];
+
+	b->paths = arena_calloc(&state->arena, sizeof(*b->paths),
+				state->inodes.n_inodes);
+	b->raw = arena_calloc(&state->arena, sizeof(*b->raw),
+			      state->inodes.n_inodes);
+	b->generated = arena_calloc(&state->arena, sizeof(*b->generated),
+				    state->inodes.n_inodes);
+
+	for (size_t ino = 1; ino <= state->inodes.n_inodes; ino++) {
+		struct directory_entry *entry = state->inodes.entries[ino];
+		const char *p;
+
+		if (route_get_path(entry, path, sizeof(path)) < 0)
+			continue;
+		p = arena_strdup(&state->arena, path);
+		b->paths[b->n_paths++] = p;
+
+		if (!S_ISREG(entry->mode))
+			continue;
+
+		/* Writes must be able to restore what they overwrite */
+		if (!entry->reg_file.ops->read || !entry->reg_file.ops->write)
+			continue;
+
+		if (!strcmp(entry->name, "raw")) {
+			/* Only region raw files, not the FMAP itself */
+			if (entry->parent != state->rootdir &&
+			    open_file(b, &b->raw[b->n_raw++], p) < 0)
+				return -1;
+		} else if (open_file(b, &b->generated[b->n_generated++],
+				     p) < 0) {
+			return -1;
+		}
+	}
+
+	if (!b->n_raw || !b->n_generated) {
+		fprintf(stderr, "Image has no regions to benchmark\n");
+		return -1;
+	}
+
+	if (fmapfs_image_opendir(b->state, "/areas", &b->areas_dir) < 0) {
+		fprintf(stderr, "Unable to open /areas\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fmapfs_state state = {
+		.arena = ARENA_INIT(),
+		.lazy_lock = PTHREAD_MUTEX_INITIALIZER,
+		.opts = FMAPFS_OPTIONS_INIT(),
+	};
+	struct bench *b;
+	uint64_t *latencies;
+	size_t iterations = 100000;
+	int rv = 1;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <image_path> [iterations]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (argc == 3)
+		iterations = strtoul(argv[2], NULL, 0);
+	if (!iterations)
+		return 1;
+
+	fuse_set_log_func(bench_log);
+
+	if (fmapfs_load_image(&state, argv[1]) < 0)
+		return 2;
+
+	b = calloc(1, sizeof(*b));
+	latencies = calloc(iterations, sizeof(*latencies));
+	if (!b || !latencies)
+		goto exit;
+
+	b->state = &state;
+	if (bench_setup(b) < 0)
+		goto exit;
+
+	printf("%-16s %12s %10s %10s %10s %10s\n", "op", "ops/s", "p50(ns)",
+	       "p90(ns)", "p99(ns)", "max(ns)");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		if (run_case(b, &cases[i], latencies, iterations) < 0)
+			goto exit;
+	}
+	rv = 0;
+
+exit:
+	free(latencies);
+	free(b);
+	arena_free(&state.arena);
+	return rv;
+}
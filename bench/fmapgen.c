@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fmap.h>
+
+/*
+ * Generate synthetic FMAP images for scale testing.  The image holds an
+ * FMAP area at offset 0, optional GBB, VPD and CBFS areas with minimal
+ * valid payloads, and n equally sized leaf areas.  With nesting, every
+ * group of leaves (and then of groups) is covered by a parent section,
+ * like RO_SECTION covers the GBB in real images.
+ *
+ * The image is written sparse unless filling is requested.
+ */
+
+#define ALIGN 4096
+#define MAX_IMAGE_SIZE 0xfffff000ull
+
+struct gen_opts {
+	uint64_t size;
+	unsigned int n_leaves;
+	unsigned int depth;
+	unsigned int branch;
+	bool gbb;
+	bool vpd;
+	bool cbfs;
+	bool fill;
+	unsigned int seed;
+};
+
+#define GBB_SIZE (64 * 1024)
+#define VPD_SIZE (16 * 1024)
+#define CBFS_SIZE (256 * 1024)
+
+static void show_help(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <output>\n"
+		"\n"
+		"    -s SIZE     image size, with an optional K/M/G suffix\n"
+		"                (default 16M, at most 4G - 4K)\n"
+		"    -n COUNT    number of leaf areas (default 1000)\n"
+		"    -d DEPTH    levels of parent sections over the leaves\n"
+		"    -b BRANCH   children per parent section (default 16)\n"
+		"    -g          add a GBB area\n"
+		"    -v          add RO_VPD and RW_VPD areas\n"
+		"    -c          add a COREBOOT area holding a CBFS\n"
+		"    -f          fill the image with pseudo-random data\n"
+		"    -r SEED     seed for -f (default 0)\n",
+		progname);
+}
+
+static int parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+	uint64_t val;
+
+	errno = 0;
+	val = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+		val <<= 10;
+		/* fallthrough */
+	case 'M':
+		val <<= 10;
+		/* fallthrough */
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+
+	if (*end)
+		return -1;
+
+	*size = val;
+	return 0;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static int write_all(int fd, const void *buf, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t rv = pwrite(fd, buf, size, offset);
+
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite");
+			return -1;
+		}
+		buf += rv;
+		size -= rv;
+		offset += rv;
+	}
+
+	return 0;
+}
+
+static int fill_image(int fd, uint64_t size, unsigned int seed)
+{
+	const size_t chunk = 1 << 20;
+	uint64_t state = 0x9e3779b97f4a7c15ull ^ seed;
+	uint64_t *buf = malloc(chunk);
+	int rv = 0;
+
+	if (!buf)
+		return -1;
+
+	for (uint64_t offset = 0; offset < size && !rv; offset += chunk) {
+		size_t n = size - offset < chunk ? size - offset : chunk;
+
+		for (size_t i = 0; i < chunk / sizeof(*buf); i++)
+			buf[i] = xorshift64(&state);
+		rv = write_all(fd, buf, n, offset);
+	}
+
+	free(buf);
+	return rv;
+}
+
+/* A GBB header with a HWID and no keys or bitmaps */
+static int write_gbb(int fd, off_t offset)
+{
+	uint8_t gbb[256 + 128] = { 0 };
+	uint32_t header_size = 128;
+	uint32_t hwid_offset = 128;
+	uint32_t hwid_size = 256;
+	uint16_t major = 1;
+	uint16_t minor = 2;
+
+	memcpy(gbb, "$GBB", 4);
+	memcpy(gbb + 4, &major, 2);
+	memcpy(gbb + 6, &minor, 2);
+	memcpy(gbb + 8, &header_size, 4);
+	memcpy(gbb + 16, &hwid_offset, 4);
+	memcpy(gbb + 20, &hwid_size, 4);
+	strcpy((char *)gbb + hwid_offset, "SYNTHETIC TEST 0000");
+
+	return write_all(fd, gbb, sizeof(gbb), offset);
+}
+
+/* VPD 2.0 key/value pairs: type 1 (string), length-prefixed key, value */
+static int write_vpd(int fd, off_t offset, const char *region)
+{
+	const char *pairs[][2] = {
+		{ "serial_number", "SYNTHETIC0000" },
+		{ "region", region },
+	};
+	uint8_t vpd[256];
+	size_t pos = 0;
+
+	memset(vpd, 0xff, sizeof(vpd));
+	for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+		vpd[pos++] = 0x01;
+		for (int j = 0; j < 2; j++) {
+			size_t len = strlen(pairs[i][j]);
+
+			vpd[pos++] = len;
+			memcpy(vpd + pos, pairs[i][j], len);
+			pos += len;
+		}
+	}
+	vpd[pos++] = 0x00;
+
+	return write_all(fd, vpd, sizeof(vpd), offset);
+}
+
+static void put_be32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* A CBFS holding a single empty file */
+static int write_cbfs(int fd, off_t offset, uint32_t size)
+{
+	uint8_t cbfs[128] = { 0 };
+
+	/* Master header */
+	put_be32(cbfs, 0x4f524243);
+	put_be32(cbfs + 4, 0x31313132);
+	put_be32(cbfs + 8, size);
+	put_be32(cbfs + 16, 64);
+	put_be32(cbfs + 20, 64);
+
+	/* File header at the first aligned offset */
+	memcpy(cbfs + 64, "LARCHIVE", 8);
+	put_be32(cbfs + 72, 0);
+	put_be32(cbfs + 76, 0x50);
+	put_be32(cbfs + 84, 40);
+	strcpy((char *)cbfs + 88, "synthetic");
+
+	return write_all(fd, cbfs, sizeof(cbfs), offset);
+}
+
+static int append(struct fmap **fmap, uint64_t offset, uint64_t size,
+		  const char *name)
+{
+	if (fmap_append_area(fmap, offset, size, (const uint8_t *)name, 0) <
+	    0) {
+		fprintf(stderr, "Unable to add area %s\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned int count_parents(struct gen_opts *opts)
+{
+	unsigned int total = 0;
+	unsigned int level = opts->n_leaves;
+
+	for (unsigned int d = 0; d < opts->depth && level > 1; d++) {
+		level = (level + opts->branch - 1) / opts->branch;
+		total += level;
+	}
+
+	return total;
+}
+
+static int generate(struct gen_opts *opts, const char *path)
+{
+	unsigned int n_areas = 1 + opts->gbb + 2 * opts->vpd + opts->cbfs +
+			       opts->n_leaves + count_parents(opts);
+	uint64_t fmap_bytes = sizeof(struct fmap) +
+			      (uint64_t)n_areas * sizeof(struct fmap_area);
+	uint64_t fmap_area_size = (fmap_bytes + ALIGN - 1) / ALIGN * ALIGN;
+	uint64_t offset = fmap_area_size;
+	uint64_t leaves_start, leaf_size;
+	struct fmap *fmap;
+	char name[FMAP_STRLEN];
+	int fd;
+	int rv = -1;
+
+	if (n_areas > 0xffff) {
+		fprintf(stderr, "Too many areas (%u)\n", n_areas);
+		return -1;
+	}
+
+	fmap = fmap_create(0, opts->size, (uint8_t *)"SYNTHETIC");
+	if (!fmap)
+		return -1;
+
+	if (append(&fmap, 0, fmap_area_size, "FMAP") < 0)
+		goto exit;
+
+	if (opts->gbb) {
+		if (append(&fmap, offset, GBB_SIZE, "GBB") < 0)
+			goto exit;
+		offset += GBB_SIZE;
+	}
+
+	if (opts->vpd) {
+		if (append(&fmap, offset, VPD_SIZE, "RO_VPD") < 0 ||
+		    append(&fmap, offset + VPD_SIZE, VPD_SIZE, "RW_VPD") < 0)
+			goto exit;
+		offset += 2 * VPD_SIZE;
+	}
+
+	if (opts->cbfs) {
+		if (append(&fmap, offset, CBFS_SIZE, "COREBOOT") < 0)
+			goto exit;
+		offset += CBFS_SIZE;
+	}
+
+	leaves_start = offset;
+	leaf_size = 0;
+	if (opts->n_leaves && opts->size > offset)
+		leaf_size = (opts->size - offset) / opts->n_leaves / ALIGN *
+			    ALIGN;
+	if (opts->n_leaves && !leaf_size) {
+		fprintf(stderr, "Image is too small for %u areas\n",
+			opts->n_leaves);
+		goto exit;
+	}
+
+	for (unsigned int i = 0; i < opts->n_leaves; i++) {
+		snprintf(name, sizeof(name), "AREA_%05u", i);
+		if (append(&fmap, leaves_start + i * leaf_size, leaf_size,
+			   name) < 0)
+			goto exit;
+	}
+
+	/* Each level of sections covers `branch` children of the level below */
+	for (unsigned int d = 0, n = opts->n_leaves, span = 1;
+	     d < opts->depth && n > 1; d++) {
+		unsigned int children = span * opts->branch;
+
+		n = (n + opts->branch - 1) / opts->branch;
+		for (unsigned int i = 0; i < n; i++) {
+			unsigned int first = i * children;
+			unsigned int count = opts->n_leaves - first;
+
+			if (count > children)
+				count = children;
+			snprintf(name, sizeof(name), "SECTION_L%u_%05u", d + 1,
+				 i);
+			if (append(&fmap, leaves_start + first * leaf_size,
+				   count * leaf_size, name) < 0)
+				goto exit;
+		}
+		span = children;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		goto exit;
+	}
+
+	if (ftruncate(fd, opts->size) < 0) {
+		perror("ftruncate");
+		goto exit_close;
+	}
+
+	if (opts->fill && fill_image(fd, opts->size, opts->seed) < 0)
+		goto exit_close;
+
+	if (write_all(fd, fmap, fmap_size(fmap), 0) < 0)
+		goto exit_close;
+
+	offset = fmap_area_size;
+	if (opts->gbb) {
+		if (write_gbb(fd, offset) < 0)
+			goto exit_close;
+		offset += GBB_SIZE;
+	}
+
+	if (opts->vpd) {
+		if (write_vpd(fd, offset, "us") < 0 ||
+		    write_vpd(fd, offset + VPD_SIZE, "us") < 0)
+			goto exit_close;
+		offset += 2 * VPD_SIZE;
+	}
+
+	if (opts->cbfs && write_cbfs(fd, offset, CBFS_SIZE) < 0)
+		goto exit_close;
+
+	rv = 0;
+
+exit_close:
+	if (close(fd) < 0 && !rv) {
+		perror("close");
+		rv = -1;
+	}
+exit:
+	fmap_destroy(fmap);
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	struct gen_opts opts = {
+		.size = 16 << 20,
+		.n_leaves = 1000,
+		.branch = 16,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:d:b:gvcfr:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (parse_size(optarg, &opts.size) < 0) {
+				fprintf(stderr, "Invalid size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			opts.n_leaves = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			opts.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.branch = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			opts.gbb = true;
+			break;
+		case 'v':
+			opts.vpd = true;
+			break;
+		case 'c':
+			opts.cbfs = true;
+			break;
+		case 'f':
+			opts.fill = true;
+			break;
+		case 'r':
+			opts.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			show_help(argv[0]);
+			return 0;
+		default:
+			show_help(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (opts.size > MAX_IMAGE_SIZE) {
+		fprintf(stderr, "Image size must be below 4G\n");
+		return 1;
+	}
+
+	if (opts.branch < 2) {
+		fprintf(stderr, "Sections need at least 2 children\n");
+		return 1;
+	}
+
+	return generate(&opts, argv[optind]) < 0 ? 1 : 0;
+}
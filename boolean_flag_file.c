@@ -8,40 +8,34 @@
 
 #include "arena.h"
 #include "boolean_flag_file.h"
+#include "image.h"
+#include "log.h"
+#include "rendered_file.h"
 #include "route.h"
 
 struct flag_priv {
-	uint8_t *val;
+	struct image *image;
+	off_t image_offset;
 	uint8_t mask;
 };
 
-static size_t get_size(void *param)
-{
-	return 2;
-}
-
-static int bool_read(char *buf, size_t n_bytes, off_t offset,
-		     struct fuse_file_info *fi, void *priv_in)
+static size_t bool_render(char *buf, size_t size, void *priv_in)
 {
 	struct flag_priv *priv = priv_in;
-	char val_buf[3] = { 0 };
+	uint8_t val;
 
-	if (offset >= 2)
+	if (image_read(priv->image, &val, 1, priv->image_offset) < 0)
 		return 0;
 
-	snprintf(val_buf, sizeof(val_buf), "%d\n", !!(*priv->val & priv->mask));
-
-	if (n_bytes + offset >= 2)
-		n_bytes = 2 - offset;
-
-	memcpy(buf, val_buf + offset, n_bytes);
-	return n_bytes;
+	return snprintf(buf, size, "%d\n", !!(val & priv->mask));
 }
 
 static int bool_write(const char *buf, size_t n_bytes, off_t offset,
 		      struct fuse_file_info *fi, void *priv_in)
 {
 	struct flag_priv *priv = priv_in;
+	uint8_t flags;
+	ssize_t rv;
 	char val;
 
 	if (offset == 1)
@@ -52,41 +46,58 @@ static int bool_write(const char *buf, size_t n_bytes, off_t offset,
 		return 0;
 
 	val = tolower(buf[0]);
-	fuse_log(FUSE_LOG_DEBUG, "boolean set \"%-.*s\"", (int)n_bytes, buf);
-	fuse_log(FUSE_LOG_DEBUG, "current flags %04X", *priv->val);
+	fmapfs_log(FUSE_LOG_DEBUG, "boolean set \"%-.*s\"", (int)n_bytes, buf);
+
+	/*
+	 * Other flags may share the byte.  Their views overlap this one's,
+	 * so the view locks serialize the read-modify-write.
+	 */
+	rv = image_read(priv->image, &flags, 1, priv->image_offset);
+	if (rv < 0)
+		return rv;
+	fmapfs_log(FUSE_LOG_DEBUG, "current flags %02X", flags);
 
 	if (val == '0' || val == 't' || val == 'y')
-		*priv->val &= ~priv->mask;
+		flags &= ~priv->mask;
 	else if (val == '1' || val == 'f' || val == 'n')
-		*priv->val |= priv->mask;
+		flags |= priv->mask;
 	else
 		return 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "new flags %04X", *priv->val);
+	rv = image_write(priv->image, &flags, 1, priv->image_offset);
+	if (rv < 0)
+		return rv;
+	fmapfs_log(FUSE_LOG_DEBUG, "new flags %02X", flags);
 
 	return n_bytes;
 }
 
-static struct file_ops ops = {
-	.get_size = get_size,
-	.read = bool_read,
+static void bool_get_extent(void *priv_in, struct file_extent *extent)
+{
+	struct flag_priv *priv = priv_in;
+
+	extent->offset = priv->image_offset;
+	extent->size = 1;
+	extent->linear = false;
+}
+
+static const struct render_ops ops = {
+	.render = bool_render,
 	.write = bool_write,
+	.get_extent = bool_get_extent,
 };
 
 void add_boolean_flag_file(struct arena *arena, struct directory *basedir,
-			   const char *name, void *val, unsigned int bit)
+			   const char *name, struct image *image,
+			   off_t image_offset, unsigned int bit)
 {
 	struct flag_priv *priv =
 		arena_calloc(arena, sizeof(struct flag_priv), 1);
 
-	/* assumes little endian */
-	while (bit >= 8) {
-		bit -= 8;
-		val++;
-	}
-
-	priv->val = val;
-	priv->mask = 1 << bit;
+	/* Flag words are little endian */
+	priv->image = image;
+	priv->image_offset = image_offset + bit / 8;
+	priv->mask = 1 << (bit % 8);
 
-	route_new_file(arena, basedir, name, &ops, priv);
+	add_rendered_file(arena, basedir, name, &ops, priv, 3);
 }
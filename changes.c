@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fmap.h>
+#include <fuse.h>
+
+#include "arena.h"
+#include "changes.h"
+#include "fmap_scan.h"
+#include "image.h"
+#include "log.h"
+#include "route.h"
+#include "snapshot_file.h"
+
+/*
+ * The image tracks the pages written since it was opened.  These files
+ * report them by erase block, for flashing only what changed:
+ *
+ * bitmap   one bit per erase block, block N in bit N % 8 of byte N / 8
+ * areas    FMAP areas with a written page, one name per line
+ * layout   a flashrom layout with a region per run of written blocks
+ * include  the flashrom arguments selecting those regions
+ *
+ * The areas are those of the FMAP in the image when the file is opened,
+ * which writes to /raw may have changed since the tree was built.
+ */
+struct changes {
+	struct image *image;
+	off_t fmap_offset;
+	size_t erase_size;
+};
+
+bool changes_erase_size_valid(size_t erase_size)
+{
+	return erase_size >= (1 << IMAGE_DIRTY_SHIFT) &&
+	       !(erase_size & (erase_size - 1));
+}
+
+static size_t changes_n_blocks(struct changes *changes)
+{
+	return (changes->image->size + changes->erase_size - 1) /
+	       changes->erase_size;
+}
+
+static bool changes_block(struct changes *changes, size_t block)
+{
+	return image_changed(changes->image, block * changes->erase_size,
+			     changes->erase_size);
+}
+
+static int print_bitmap(FILE *out, void *param)
+{
+	struct changes *changes = param;
+	size_t n_blocks = changes_n_blocks(changes);
+
+	for (size_t block = 0; block < n_blocks; block += 8) {
+		uint8_t byte = 0;
+
+		for (size_t bit = 0; bit < 8 && block + bit < n_blocks; bit++)
+			if (changes_block(changes, block + bit))
+				byte |= 1 << bit;
+		fputc(byte, out);
+	}
+
+	return 0;
+}
+
+static int print_areas(FILE *out, void *param)
+{
+	struct changes *changes = param;
+	struct image *image = changes->image;
+	off_t offset = changes->fmap_offset;
+	struct fmap header;
+	ssize_t rv;
+
+	rv = image_read(image, &header, sizeof(header), offset);
+	if (rv < 0)
+		return rv;
+	if (!fmap_header_valid(&header, image->size - offset)) {
+		fmapfs_log(FUSE_LOG_ERR, "No valid FMAP at 0x%08llx anymore",
+			   (unsigned long long)offset);
+		return -EIO;
+	}
+
+	offset += sizeof(header);
+	for (size_t i = 0; i < header.nareas; i++) {
+		struct fmap_area area;
+
+		rv = image_read(image, &area, sizeof(area), offset);
+		if (rv < 0)
+			return rv;
+		offset += sizeof(area);
+
+		if (image_changed(image, area.offset, area.size))
+			fprintf(out, "%.*s\n", (int)sizeof(area.name),
+				(const char *)area.name);
+	}
+
+	return 0;
+}
+
+/*
+ * Call fn with the first and last byte of each run of changed blocks,
+ * the last block ending with the image.
+ */
+static void changes_for_each_run(struct changes *changes,
+				 void (*fn)(size_t start, size_t end,
+					    FILE *out),
+				 FILE *out)
+{
+	size_t n_blocks = changes_n_blocks(changes);
+	size_t run_start = 0;
+	bool in_run = false;
+
+	for (size_t block = 0; block <= n_blocks; block++) {
+		bool changed = block < n_blocks &&
+			       changes_block(changes, block);
+
+		if (changed && !in_run) {
+			run_start = block;
+			in_run = true;
+		} else if (!changed && in_run) {
+			size_t end = block * changes->erase_size;
+
+			if (end > changes->image->size)
+				end = changes->image->size;
+			fn(run_start * changes->erase_size, end - 1, out);
+			in_run = false;
+		}
+	}
+}
+
+/* flashrom layouts are "start:end name", inclusive and in hex */
+static void print_layout_region(size_t start, size_t end, FILE *out)
+{
+	fprintf(out, "%08zx:%08zx changed_%08zx\n", start, end, start);
+}
+
+static void print_include_region(size_t start, size_t end, FILE *out)
+{
+	fprintf(out, "-i changed_%08zx\n", start);
+}
+
+static int print_layout(FILE *out, void *param)
+{
+	changes_for_each_run(param, print_layout_region, out);
+	return 0;
+}
+
+static int print_include(FILE *out, void *param)
+{
+	changes_for_each_run(param, print_include_region, out);
+	return 0;
+}
+
+void add_changes_dir(struct arena *arena, struct directory *basedir,
+		     struct image *image, off_t fmap_offset, size_t erase_size)
+{
+	struct changes *changes =
+		arena_calloc(arena, sizeof(struct changes), 1);
+	struct directory *dir =
+		route_new_subdirectory(arena, basedir, "changes");
+
+	changes->image = image;
+	changes->fmap_offset = fmap_offset;
+	changes->erase_size = erase_size;
+
+	add_snapshot_file(arena, dir, "bitmap", print_bitmap, changes);
+	add_snapshot_file(arena, dir, "areas", print_areas, changes);
+	add_snapshot_file(arena, dir, "layout", print_layout, changes);
+	add_snapshot_file(arena, dir, "include", print_include, changes);
+}
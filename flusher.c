@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <fuse.h>
+
+#include "flusher.h"
+#include "image.h"
+#include "log.h"
+
+static const char *const policy_names[] = {
+	[FLUSH_FSYNC] = "fsync",
+	[FLUSH_CLOSE] = "close",
+	[FLUSH_INTERVAL] = "interval",
+	[FLUSH_WRITE] = "write",
+};
+
+int flusher_init(struct flusher *flusher, struct image *image,
+		 const char *policy, double interval)
+{
+	size_t i;
+
+	*flusher = (struct flusher){
+		.image = image,
+		.policy = FLUSH_INTERVAL,
+		.interval = interval,
+	};
+
+	for (i = 0; policy && i < sizeof(policy_names) / sizeof(*policy_names);
+	     i++)
+		if (!strcmp(policy, policy_names[i]))
+			break;
+	if (policy && i == sizeof(policy_names) / sizeof(*policy_names)) {
+		fmapfs_log(FUSE_LOG_ERR, "Unknown flush policy %s", policy);
+		return -1;
+	}
+	if (policy)
+		flusher->policy = i;
+
+	if (flusher->policy == FLUSH_INTERVAL && !(interval > 0)) {
+		fmapfs_log(FUSE_LOG_ERR, "Invalid flush interval %g", interval);
+		return -1;
+	}
+
+	pthread_mutex_init(&flusher->lock, NULL);
+	pthread_cond_init(&flusher->cond, NULL);
+
+	return 0;
+}
+
+static void *flusher_thread(void *arg)
+{
+	struct flusher *flusher = arg;
+	time_t secs = flusher->interval;
+	long nsecs = (flusher->interval - secs) * 1e9;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&flusher->lock);
+	while (!flusher->stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += secs;
+		deadline.tv_nsec += nsecs;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!flusher->stopping &&
+		       pthread_cond_timedwait(&flusher->cond, &flusher->lock,
+					      &deadline) != ETIMEDOUT)
+			;
+
+		/* Whatever is left is flushed when the image is closed */
+		if (flusher->stopping)
+			break;
+
+		pthread_mutex_unlock(&flusher->lock);
+		image_flush(flusher->image, true);
+		pthread_mutex_lock(&flusher->lock);
+	}
+	pthread_mutex_unlock(&flusher->lock);
+
+	return NULL;
+}
+
+int flusher_start(struct flusher *flusher)
+{
+	int rv;
+
+	if (flusher->policy != FLUSH_INTERVAL)
+		return 0;
+
+	pthread_mutex_lock(&flusher->lock);
+	flusher->stopping = false;
+	rv = pthread_create(&flusher->thread, NULL, flusher_thread, flusher);
+	if (rv)
+		fmapfs_log(FUSE_LOG_ERR, "Unable to start flusher thread: %s",
+			   strerror(rv));
+	else
+		flusher->running = true;
+	pthread_mutex_unlock(&flusher->lock);
+
+	return rv ? -1 : 0;
+}
+
+void flusher_stop(struct flusher *flusher)
+{
+	pthread_mutex_lock(&flusher->lock);
+	if (!flusher->running) {
+		pthread_mutex_unlock(&flusher->lock);
+		return;
+	}
+	flusher->running = false;
+	flusher->stopping = true;
+	pthread_cond_signal(&flusher->cond);
+	pthread_mutex_unlock(&flusher->lock);
+
+	pthread_join(flusher->thread, NULL);
+}
+
+/* Just the pages written, others are their own writers' to wait for */
+int flusher_written(struct flusher *flusher, off_t offset, size_t n_bytes)
+{
+	if (flusher->policy != FLUSH_WRITE)
+		return 0;
+
+	return image_flush_range(flusher->image, offset, n_bytes, true);
+}
+
+/* Otherwise, get writeback going so the next flush has less to wait for */
+int flusher_close(struct flusher *flusher)
+{
+	if (flusher->policy == FLUSH_CLOSE)
+		return image_flush(flusher->image, true);
+	if (flusher->policy == FLUSH_INTERVAL)
+		return image_flush(flusher->image, false);
+
+	return 0;
+}
+
+int flusher_fsync(struct flusher *flusher)
+{
+	return image_flush(flusher->image, true);
+}
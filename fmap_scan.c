@@ -0,0 +1,390 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fmap.h>
+
+#include "fmap_scan.h"
+#include "image.h"
+#include "log.h"
+
+/*
+ * fmap_find() from libflashmap compares the signature at every byte
+ * offset unless the image size is a power of two, and takes the first
+ * match even when it's just the string in some code.  Instead, probe the
+ * aligned offsets where images keep their FMAP first, touching one page
+ * per probe, and only scan the whole image when none of them holds one.
+ * Probes stop at 64 KiB alignment rather than going down to every page,
+ * where the full scan, reading ahead, beats faulting pages in one by one.
+ * The full scan looks for the 'F' of the signature with memchr(), which
+ * is vectorized in glibc and skips over 0xff padding at memory speed,
+ * and checks the header around each hit before taking it.  Large images
+ * are split into chunks scanned in parallel, so the fallback scales with
+ * cores rather than image size.
+ */
+
+#define FMAP_SIGNATURE_LEN (sizeof(FMAP_SIGNATURE) - 1)
+
+/* Smallest alignment probed before falling back to a full scan */
+#define FMAP_SCAN_MIN_ALIGN (64 << 10)
+
+/* Threads sharing a full scan, each taking at least a chunk this big */
+#define FMAP_SCAN_MAX_THREADS 16
+#define FMAP_SCAN_MIN_CHUNK (32 << 20)
+
+/* Bytes read at a time when scanning an image which isn't mapped */
+#define FMAP_SCAN_READ_CHUNK (1 << 20)
+
+bool fmap_header_valid(const struct fmap *fmap, size_t avail)
+{
+	size_t table_size;
+
+	if (avail < sizeof(*fmap))
+		return false;
+
+	if (memcmp(fmap->signature, FMAP_SIGNATURE, FMAP_SIGNATURE_LEN))
+		return false;
+
+	if (fmap->ver_major != FMAP_VER_MAJOR)
+		return false;
+
+	if (!memchr(fmap->name, '\0', sizeof(fmap->name)))
+		return false;
+
+	table_size = avail - sizeof(*fmap);
+	if (table_size / sizeof(fmap->areas[0]) < fmap->nareas)
+		return false;
+
+	return true;
+}
+
+bool fmap_scan_valid(const uint8_t *image, size_t size, size_t offset)
+{
+	if (offset > size)
+		return false;
+
+	return fmap_header_valid((const struct fmap *)(image + offset),
+				 size - offset);
+}
+
+/* "__FMAP__": '_' is common in strings, 'F' much less so */
+#define FMAP_SCAN_KEY_POS 2
+
+/*
+ * Offset of the first valid header starting in [from, to), or to.  The
+ * key byte of a header starting just before to lies past it, so the
+ * search overlaps the next range by FMAP_SCAN_KEY_POS bytes.
+ */
+static size_t fmap_scan_next(const uint8_t *image, size_t size, size_t from,
+			     size_t to)
+{
+	const uint8_t *end = image + to + FMAP_SCAN_KEY_POS;
+	const uint8_t *p = image + from + FMAP_SCAN_KEY_POS;
+
+	if (end > image + size)
+		end = image + size;
+
+	while (p < end) {
+		p = memchr(p, FMAP_SIGNATURE[FMAP_SCAN_KEY_POS], end - p);
+		if (!p)
+			break;
+
+		from = p - image - FMAP_SCAN_KEY_POS;
+		if (fmap_scan_valid(image, size, from))
+			return from;
+		p++;
+	}
+
+	return to;
+}
+
+/* Let the kernel read ahead aggressively while the whole image is scanned */
+static void fmap_scan_advise(const uint8_t *image, size_t size, int advice)
+{
+	uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	uintptr_t start = (uintptr_t)image & ~page_mask;
+
+	/* Only a hint, and the image needn't be a mapping at all */
+	madvise((void *)start, (uintptr_t)image + size - start, advice);
+}
+
+static unsigned int fmap_scan_alignment(size_t offset)
+{
+	return offset ? __builtin_ctzll(offset) : 64;
+}
+
+/* A share of the full scan: the headers starting in [start, end) */
+struct fmap_scan_chunk {
+	const uint8_t *image;
+	size_t size;
+	size_t start;
+	size_t end;
+
+	pthread_t thread;
+	bool started;
+
+	/* Most aligned valid header found, or -1, and how many there were */
+	ssize_t best;
+	size_t n_found;
+};
+
+static void *fmap_scan_chunk(void *arg)
+{
+	struct fmap_scan_chunk *chunk = arg;
+	const uint8_t *image = chunk->image;
+
+	chunk->best = -1;
+	chunk->n_found = 0;
+	for (size_t offset = fmap_scan_next(image, chunk->size, chunk->start,
+					    chunk->end);
+	     offset < chunk->end;
+	     offset = fmap_scan_next(image, chunk->size, offset + 1,
+				     chunk->end)) {
+		fmapfs_log(FUSE_LOG_DEBUG, "FMAP candidate at 0x%zx", offset);
+		if (chunk->best < 0 || fmap_scan_alignment(offset) >
+					       fmap_scan_alignment(chunk->best))
+			chunk->best = offset;
+		chunk->n_found++;
+	}
+
+	return NULL;
+}
+
+static unsigned int fmap_scan_threads(size_t size)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n = size / FMAP_SCAN_MIN_CHUNK;
+
+	if (cpus > 0 && n > cpus)
+		n = cpus;
+	if (n > FMAP_SCAN_MAX_THREADS)
+		n = FMAP_SCAN_MAX_THREADS;
+
+	return n ? n : 1;
+}
+
+/* Scan the whole image, sharing the work between threads */
+static ssize_t fmap_scan_full(const uint8_t *image, size_t size,
+			      size_t *n_found)
+{
+	struct fmap_scan_chunk chunks[FMAP_SCAN_MAX_THREADS];
+	unsigned int n_chunks = fmap_scan_threads(size);
+	size_t chunk_size = size / n_chunks + 1;
+	ssize_t best = -1;
+
+	for (unsigned int i = 0; i < n_chunks; i++) {
+		chunks[i] = (struct fmap_scan_chunk){
+			.image = image,
+			.size = size,
+			.start = i * chunk_size,
+			.end = i + 1 < n_chunks ? (i + 1) * chunk_size : size,
+		};
+	}
+
+	/* Chunks without a thread of their own are scanned here */
+	for (unsigned int i = 1; i < n_chunks; i++)
+		chunks[i].started = !pthread_create(&chunks[i].thread, NULL,
+						    fmap_scan_chunk,
+						    &chunks[i]);
+	for (unsigned int i = 0; i < n_chunks; i++) {
+		if (chunks[i].started)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			fmap_scan_chunk(&chunks[i]);
+	}
+
+	/* Chunks are in image order, so keep the first of equals */
+	*n_found = 0;
+	for (unsigned int i = 0; i < n_chunks; i++) {
+		struct fmap_scan_chunk *chunk = &chunks[i];
+
+		*n_found += chunk->n_found;
+		if (chunk->best < 0)
+			continue;
+		if (best < 0 || fmap_scan_alignment(chunk->best) >
+					fmap_scan_alignment(best))
+			best = chunk->best;
+	}
+
+	return best;
+}
+
+/*
+ * Probe offset 0, then the aligned offsets from the largest alignment
+ * down, returning the first offset at which probe() finds a header, or -1.
+ */
+static ssize_t fmap_scan_probe(size_t size,
+			       bool (*probe)(void *ctx, size_t offset),
+			       void *ctx)
+{
+	size_t stride = 1;
+
+	if (probe(ctx, 0))
+		return 0;
+
+	while (stride <= size / 2)
+		stride *= 2;
+
+	/* Odd multiples of each stride, so every offset is probed once */
+	for (; stride >= FMAP_SCAN_MIN_ALIGN; stride /= 2) {
+		for (size_t offset = stride; offset < size;
+		     offset += 2 * stride) {
+			if (probe(ctx, offset))
+				return offset;
+		}
+	}
+
+	return -1;
+}
+
+static void fmap_scan_report(ssize_t best, size_t n)
+{
+	if (n > 1)
+		fmapfs_log(FUSE_LOG_INFO,
+			   "Found %zu FMAP headers, using the one at 0x%zx", n,
+			   (size_t)best);
+}
+
+struct fmap_scan_mem {
+	const uint8_t *image;
+	size_t size;
+};
+
+static bool fmap_scan_probe_mem(void *ctx, size_t offset)
+{
+	struct fmap_scan_mem *mem = ctx;
+
+	return fmap_scan_valid(mem->image, mem->size, offset);
+}
+
+ssize_t fmap_scan(const uint8_t *image, size_t size)
+{
+	struct fmap_scan_mem mem = { .image = image, .size = size };
+	ssize_t best;
+	size_t n;
+
+	best = fmap_scan_probe(size, fmap_scan_probe_mem, &mem);
+	if (best >= 0)
+		return best;
+
+	fmap_scan_advise(image, size, MADV_SEQUENTIAL);
+	best = fmap_scan_full(image, size, &n);
+	fmap_scan_advise(image, size, MADV_NORMAL);
+
+	fmap_scan_report(best, n);
+
+	return best;
+}
+
+static bool fmap_scan_probe_image(void *ctx, size_t offset)
+{
+	struct image *image = ctx;
+	struct fmap fmap;
+
+	if (image->size - offset < sizeof(fmap))
+		return false;
+
+	if (image_read(image, &fmap, sizeof(fmap), offset) < 0)
+		return false;
+
+	return fmap_header_valid(&fmap, image->size - offset);
+}
+
+/*
+ * Without a mapping, the full scan reads the image in chunks, each
+ * overlapping the next by a header so that headers straddling the
+ * boundary are seen whole.  Reads are sequential, so it stays on one
+ * thread and lets the device's readahead do the work.
+ */
+static ssize_t fmap_scan_image_full(struct image *image, size_t *n_found)
+{
+	size_t buf_size = FMAP_SCAN_READ_CHUNK + sizeof(struct fmap);
+	ssize_t best = -1;
+	uint8_t *buf;
+
+	*n_found = 0;
+	buf = malloc(buf_size);
+	if (!buf)
+		return -1;
+
+	if (image->fd >= 0)
+		posix_fadvise(image->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (size_t start = 0; start < image->size;
+	     start += FMAP_SCAN_READ_CHUNK) {
+		size_t len = image->size - start;
+		const uint8_t *limit;
+		size_t end;
+
+		if (len > buf_size)
+			len = buf_size;
+		if (image_read(image, buf, len, start) < 0) {
+			fmapfs_log(FUSE_LOG_ERR,
+				   "Failed to read the image at 0x%zx", start);
+			break;
+		}
+
+		/*
+		 * Headers starting in this chunk.  Their area tables may run
+		 * past the buffer, so they are checked against the image.
+		 */
+		end = len < FMAP_SCAN_READ_CHUNK ? len : FMAP_SCAN_READ_CHUNK;
+		limit = buf + (end + FMAP_SCAN_KEY_POS < len ?
+				       end + FMAP_SCAN_KEY_POS :
+				       len);
+		for (const uint8_t *p = buf + FMAP_SCAN_KEY_POS; p < limit;
+		     p++) {
+			const struct fmap *fmap;
+			size_t offset;
+
+			p = memchr(p, FMAP_SIGNATURE[FMAP_SCAN_KEY_POS],
+				   limit - p);
+			if (!p)
+				break;
+
+			offset = p - buf - FMAP_SCAN_KEY_POS;
+			fmap = (const struct fmap *)(buf + offset);
+			if (!fmap_header_valid(fmap,
+					       image->size - start - offset))
+				continue;
+
+			offset += start;
+			fmapfs_log(FUSE_LOG_DEBUG, "FMAP candidate at 0x%zx",
+				   offset);
+			if (best < 0 || fmap_scan_alignment(offset) >
+						fmap_scan_alignment(best))
+				best = offset;
+			(*n_found)++;
+		}
+	}
+
+	if (image->fd >= 0)
+		posix_fadvise(image->fd, 0, 0, POSIX_FADV_NORMAL);
+	free(buf);
+
+	return best;
+}
+
+ssize_t fmap_scan_image(struct image *image)
+{
+	ssize_t best;
+	size_t n;
+
+	if (image->mem)
+		return fmap_scan(image->mem, image->size);
+
+	best = fmap_scan_probe(image->size, fmap_scan_probe_image, image);
+	if (best >= 0)
+		return best;
+
+	best = fmap_scan_image_full(image, &n);
+	fmap_scan_report(best, n);
+
+	return best;
+}
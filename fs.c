@@ -1,6 +1,9 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -9,52 +12,70 @@
 
 #include <fmap.h>
 #include <fuse.h>
-#include <fuse_log.h>
 
 #include "arena.h"
 #include "boolean_flag_file.h"
+#include "changes.h"
+#include "fmap_scan.h"
 #include "fs.h"
 #include "gbb.h"
-#include "mmap_file.h"
+#include "image.h"
+#include "log.h"
 #include "route.h"
 #include "raw_file.h"
+#include "stats.h"
 #include "str_file.h"
+#include "trace.h"
 #include "version_file.h"
 
-static int fmap_load(uint8_t *image, size_t image_size, struct fmap **fmap_out)
+/*
+ * Find the FMAP and copy it, with its area table, into the arena.  The
+ * copy describes the layout the tree is built from; the files themselves
+ * always go to the image.
+ */
+static int fmap_load(struct fmapfs_state *state)
 {
+	struct image *image = &state->image;
 	ssize_t fmap_offset;
+	struct fmap header;
 	struct fmap *fmap;
+	size_t size;
 
-	fmap_offset = fmap_find(image, image_size);
+	fmap_offset = fmap_scan_image(image);
 	if (fmap_offset < 0) {
-		fuse_log(FUSE_LOG_ERR, "Unable to find valid FMAP structure");
+		fmapfs_log(FUSE_LOG_ERR, "Unable to find valid FMAP structure");
 		return -1;
 	}
 
-	fmap = (struct fmap *)(&image[fmap_offset]);
+	/* fmap_scan_image() checked the area table fits in the image */
+	if (image_read(image, &header, sizeof(header), fmap_offset) < 0)
+		return -1;
+	size = sizeof(header) + header.nareas * sizeof(struct fmap_area);
+	fmap = arena_malloc(&state->arena, size, 1);
+	if (image_read(image, fmap, size, fmap_offset) < 0)
+		return -1;
 
-	fuse_log(FUSE_LOG_DEBUG, "FMAP found at offset 0x%08x!",
-		 (unsigned)fmap_offset);
-	fuse_log(FUSE_LOG_DEBUG, "FMAP signature: %-.*s",
-		 (int)sizeof(fmap->signature), (char *)fmap->signature);
-	fuse_log(FUSE_LOG_DEBUG, "FMAP version %hhu.%hhu", fmap->ver_major,
-		 fmap->ver_minor);
-	fuse_log(FUSE_LOG_DEBUG, "FMAP base: 0x%016lx", fmap->base);
-	fuse_log(FUSE_LOG_DEBUG, "FMAP size: 0x%08x", fmap->size);
-	fuse_log(FUSE_LOG_DEBUG, "FMAP name: %-.*s", (int)sizeof(fmap->name),
-		 (char *)fmap->name);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP found at offset 0x%08x!",
+		   (unsigned)fmap_offset);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP signature: %-.*s",
+		   (int)sizeof(fmap->signature), (char *)fmap->signature);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP version %hhu.%hhu", fmap->ver_major,
+		   fmap->ver_minor);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP base: 0x%016lx", fmap->base);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP size: 0x%08x", fmap->size);
+	fmapfs_log(FUSE_LOG_DEBUG, "FMAP name: %-.*s", (int)sizeof(fmap->name),
+		   (char *)fmap->name);
 
 	for (size_t i = 0; i < fmap->nareas; i++) {
 		struct fmap_area *area = &fmap->areas[i];
 
-		fuse_log(
+		fmapfs_log(
 			FUSE_LOG_DEBUG,
 			"FMAP region %-.*s: offset=0x%08x, size=0x%08x, flags=0x%x",
 			(int)sizeof(area->name), (char *)area->name,
 			area->offset, area->size, area->flags);
-		if (area->offset + area->size > image_size) {
-			fuse_log(
+		if ((size_t)area->offset + area->size > image->size) {
+			fmapfs_log(
 				FUSE_LOG_ERR,
 				"FMAP region %-.*s is located outside of the image",
 				(int)sizeof(area->name), (char *)area->name);
@@ -62,35 +83,130 @@ static int fmap_load(uint8_t *image, size_t image_size, struct fmap **fmap_out)
 		}
 	}
 
-	*fmap_out = fmap;
+	state->fmap = fmap;
+	state->fmap_offset = fmap_offset;
 	return 0;
 }
 
+/* Offset in the image of a field of the FMAP header */
+#define FMAP_FIELD_OFFSET(state, field) \
+	((state)->fmap_offset + offsetof(struct fmap, field))
+
+static void add_area_files(struct fmapfs_state *state,
+			   struct directory *area_dir, size_t area_index,
+			   const char *area_name)
+{
+	struct fmap_area *area = &state->fmap->areas[area_index];
+	struct image *image = &state->image;
+	off_t flags_offset = FMAP_FIELD_OFFSET(state, areas) +
+			     area_index * sizeof(struct fmap_area) +
+			     offsetof(struct fmap_area, flags);
+
+	add_raw_file(&state->arena, area_dir, "raw", image, area->offset,
+		     area->size);
+	add_boolean_flag_file(&state->arena, area_dir, "static", image,
+			      flags_offset, __builtin_ctz(FMAP_AREA_STATIC));
+	add_boolean_flag_file(&state->arena, area_dir, "compressed", image,
+			      flags_offset,
+			      __builtin_ctz(FMAP_AREA_COMPRESSED));
+	add_boolean_flag_file(&state->arena, area_dir, "ro", image,
+			      flags_offset, __builtin_ctz(FMAP_AREA_RO));
+	add_boolean_flag_file(&state->arena, area_dir, "preserve", image,
+			      flags_offset, __builtin_ctz(FMAP_AREA_PRESERVE));
+
+	if (!strcmp(area_name, "GBB")) {
+		setup_gbb_files(&state->arena, area_dir, image, area->offset,
+				area->size);
+	}
+}
+
+/*
+ * With -o lazy, only the area directories themselves are created when
+ * the image is loaded.  Their files, and interpreters like the GBB's, are
+ * added on first lookup or listing, then frozen, numbered and given
+ * views just like the rest of the tree was at load.
+ */
+struct lazy_area {
+	struct fmapfs_state *state;
+	size_t area_index;
+};
+
+static void populate_area(struct directory_entry *entry, void *param)
+{
+	struct lazy_area *lazy = param;
+	struct fmapfs_state *state = lazy->state;
+	size_t first;
+
+	pthread_mutex_lock(&state->lazy_lock);
+	if (entry->dir->populated) {
+		pthread_mutex_unlock(&state->lazy_lock);
+		return;
+	}
+
+	add_area_files(state, entry->dir, lazy->area_index, entry->name);
+	route_freeze(&state->arena, entry);
+	first = route_extend_inode_table(&state->arena, &state->inodes, entry);
+	view_map_add(&state->views, &state->arena,
+		     state->inodes.entries + first,
+		     state->inodes.n_inodes + 1 - first);
+	/* Indexed last: lookups hitting the index skip populating */
+	if (!state->opts.lowlevel)
+		route_extend_path_index(&state->arena, &state->paths,
+					&state->inodes, first);
+
+	__atomic_store_n(&entry->dir->populated, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&state->lazy_lock);
+}
+
+static void add_lazy_area(struct fmapfs_state *state,
+			  struct directory *area_dir, size_t area_index)
+{
+	struct lazy_area *lazy = arena_calloc(&state->arena, sizeof(*lazy), 1);
+
+	lazy->state = state;
+	lazy->area_index = area_index;
+	area_dir->populate = populate_area;
+	area_dir->populate_param = lazy;
+}
+
 int fmapfs_load_image(struct fmapfs_state *state, const char *image_path)
 {
 	struct directory *areas_dir;
+	struct directory *fmapfs_dir;
 
-	state->image_size = mmap_file_path(image_path, O_RDWR, &state->image);
-	if (state->image_size < 0) {
-		fuse_log(FUSE_LOG_ERR, "Failed to mmap image file: %s",
-			 image_path);
+	if (!changes_erase_size_valid(state->opts.erase_size)) {
+		fmapfs_log(FUSE_LOG_ERR, "Invalid erase block size %u",
+			   state->opts.erase_size);
 		return -1;
 	}
 
-	if (fmap_load(state->image, state->image_size, &state->fmap) < 0) {
-		fuse_log(FUSE_LOG_ERR,
-			 "Failed to load fmap from image file: %s", image_path);
-		munmap(state->image, state->image_size);
+	if (image_open(&state->image, image_path, state->opts.backend) < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Failed to open image file: %s",
+			   image_path);
+		return -1;
+	}
+
+	if (flusher_init(&state->flusher, &state->image, state->opts.flush,
+			 state->opts.flush_interval) < 0) {
+		image_close(&state->image);
+		return -1;
+	}
+
+	if (fmap_load(state) < 0) {
+		fmapfs_log(FUSE_LOG_ERR,
+			   "Failed to load fmap from image file: %s",
+			   image_path);
+		image_close(&state->image);
 		return -1;
 	}
 
 	state->rootdir = route_new_root(&state->arena);
 	add_version_file(&state->arena, state->rootdir->dir, "version",
-			 state->fmap);
-	add_raw_file(&state->arena, state->rootdir->dir, "raw", state->fmap,
-		     fmap_size(state->fmap));
-	add_str_file(&state->arena, state->rootdir->dir, "name",
-		     (char *)state->fmap->name, sizeof(state->fmap->name),
+			 &state->image, FMAP_FIELD_OFFSET(state, ver_major));
+	add_raw_file(&state->arena, state->rootdir->dir, "raw", &state->image,
+		     state->fmap_offset, fmap_size(state->fmap));
+	add_str_file(&state->arena, state->rootdir->dir, "name", &state->image,
+		     FMAP_FIELD_OFFSET(state, name), sizeof(state->fmap->name),
 		     true);
 
 	areas_dir = route_new_subdirectory(&state->arena, state->rootdir->dir,
@@ -104,210 +220,571 @@ int fmapfs_load_image(struct fmapfs_state *state, const char *image_path)
 		struct directory *area_dir = route_new_subdirectory(
 			&state->arena, areas_dir, area_name);
 
-		add_raw_file(&state->arena, area_dir, "raw",
-			     state->image + area->offset, area->size);
-		add_boolean_flag_file(&state->arena, area_dir, "static",
-				      &area->flags,
-				      __builtin_ctz(FMAP_AREA_STATIC));
-		add_boolean_flag_file(&state->arena, area_dir, "compressed",
-				      &area->flags,
-				      __builtin_ctz(FMAP_AREA_COMPRESSED));
-		add_boolean_flag_file(&state->arena, area_dir, "ro",
-				      &area->flags,
-				      __builtin_ctz(FMAP_AREA_RO));
-		add_boolean_flag_file(&state->arena, area_dir, "preserve",
-				      &area->flags,
-				      __builtin_ctz(FMAP_AREA_PRESERVE));
-
-		if (!strcmp(area_name, "GBB")) {
-			setup_gbb_files(&state->arena, area_dir,
-					state->image + area->offset,
-					area->size);
-		}
+		if (state->opts.lazy)
+			add_lazy_area(state, area_dir, i);
+		else
+			add_area_files(state, area_dir, i, area_name);
 	}
 
+	fmapfs_dir = route_new_subdirectory(&state->arena, state->rootdir->dir,
+					    ".fmapfs");
+	add_stats_files(&state->arena, fmapfs_dir);
+	add_trace_file(&state->arena, fmapfs_dir);
+	add_changes_dir(&state->arena, fmapfs_dir, &state->image,
+			state->fmap_offset, state->opts.erase_size);
+	trace_enable(state->opts.trace);
+
+	route_freeze(&state->arena, state->rootdir);
+	route_build_inode_table(&state->arena, &state->inodes, state->rootdir);
+	if (!state->opts.lowlevel)
+		route_build_path_index(&state->arena, &state->paths,
+				       &state->inodes);
+	view_map_init(&state->views, state->image.size);
+	view_map_add(&state->views, &state->arena, state->inodes.entries + 1,
+		     state->inodes.n_inodes);
+
 	return 0;
 }
 
-static void fill_statbuf_with_dirent(struct directory_entry *entry,
-				     struct stat *st)
+int fmapfs_written(struct fmapfs_state *state, struct fuse_file_info *fi,
+		   off_t offset, size_t n_bytes)
 {
-	st->st_mode = entry->mode;
-	st->st_uid = geteuid();
-	st->st_gid = getegid();
+	struct open_file *file = (struct open_file *)(uintptr_t)fi->fh;
+	struct directory_entry *entry = file->entry;
+	size_t start;
+	size_t end;
 
-	/* TODO: don't hardcode this? */
-	if (S_ISDIR(entry->mode)) {
-		st->st_nlink = 2;
-	} else if (S_ISREG(entry->mode)) {
-		struct file_ops *ops = entry->reg_file.ops;
-		void *param = entry->reg_file.param;
+	__atomic_store_n(&file->written, true, __ATOMIC_RELAXED);
+	view_map_written(&state->views, entry, offset, n_bytes);
 
-		st->st_nlink = 1;
-		if (ops->get_size) {
-			st->st_size = ops->get_size(param);
-		} else if (ops->read) {
-			char buf[1024];
-			off_t offset = 0;
-			size_t bytes_read;
+	if (!view_image_range(entry->reg_file.view, offset, n_bytes, &start,
+			      &end))
+		return 0;
 
-			st->st_size = 0;
+	return flusher_written(&state->flusher, start, end - start);
+}
 
-			do {
-				bytes_read = ops->read(buf, sizeof(buf), offset,
-						       NULL, param);
+/* Opens which never wrote have nothing of their own to flush */
+int fmapfs_closed(struct fmapfs_state *state, struct fuse_file_info *fi)
+{
+	struct open_file *file = (struct open_file *)(uintptr_t)fi->fh;
+	int rv;
 
-				st->st_size += bytes_read;
-				offset += bytes_read;
-			} while (bytes_read == sizeof(buf));
-		} else {
-			st->st_size = 0;
-		}
-	}
+	if (!__atomic_exchange_n(&file->written, false, __ATOMIC_RELAXED))
+		return 0;
+
+	rv = flusher_close(&state->flusher);
+	if (rv < 0)
+		__atomic_store_n(&file->written, true, __ATOMIC_RELAXED);
+
+	return rv;
 }
 
-static int fmapfs_getattr(const char *path, struct stat *st,
-			  struct fuse_file_info *fi)
+/* Release an image loaded with fmapfs_load_image() */
+void fmapfs_unload_image(struct fmapfs_state *state)
+{
+	view_map_stop(&state->views);
+	flusher_stop(&state->flusher);
+	image_close(&state->image);
+	arena_free(&state->arena);
+}
+
+/*
+ * Per-open state.  The entry is resolved once on open, so reads and
+ * writes on an open file never need to touch the path.  The image it
+ * belongs to is kept too, as one session may serve several.  Files
+ * find their own state in the open_file, which comes first.
+ */
+struct fmapfs_handle {
+	struct open_file file;
+	struct fmapfs_state *state;
+};
+
+static int handle_new(struct fmapfs_state *state,
+		      struct directory_entry *entry, struct fuse_file_info *fi)
+{
+	struct fmapfs_handle *handle = calloc(1, sizeof(*handle));
+
+	if (!handle)
+		return -ENOMEM;
+
+	handle->state = state;
+	handle->file.entry = entry;
+	fi->fh = (uintptr_t)handle;
+
+	return 0;
+}
+
+static struct directory_entry *handle_entry(struct fuse_file_info *fi)
+{
+	return ((struct fmapfs_handle *)(uintptr_t)fi->fh)->file.entry;
+}
+
+struct fmapfs_state *fmapfs_handle_state(struct fuse_file_info *fi)
+{
+	return ((struct fmapfs_handle *)(uintptr_t)fi->fh)->state;
+}
+
+static void handle_free(struct fuse_file_info *fi)
+{
+	free((struct fmapfs_handle *)(uintptr_t)fi->fh);
+	fi->fh = 0;
+}
+
+/*
+ * Connection settings shared by both engines.  The route tree never
+ * changes after load, so make I/O requests as large as the kernel
+ * allows and let many of them be in flight.
+ */
+void fmapfs_tune_conn(struct fmapfs_options *opts, struct fuse_conn_info *conn)
+{
+	/* libfuse clamps this to the largest size it can buffer */
+	conn->max_write = opts->max_write ?: UINT_MAX;
+	conn->max_background = opts->max_background;
+	conn->congestion_threshold = conn->max_background * 3 / 4;
+
+	/* Splice write_buf data from the device into the image */
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+}
+
+static void *fmapfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
 	struct fmapfs_state *state = fuse_get_context()->private_data;
+
+	/* Handles carry the entry, we never need paths for open files */
+	cfg->nullpath_ok = 1;
+	cfg->hard_remove = 1;
+
+	cfg->use_ino = 1;
+	cfg->entry_timeout = state->opts.cache_timeout;
+	cfg->negative_timeout = state->opts.cache_timeout;
+	cfg->attr_timeout = state->opts.cache_timeout;
+
+	fmapfs_tune_conn(&state->opts, conn);
+
+	/* Let read_buf replies backed by the image fd be spliced */
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
+	state->views.fuse = fuse_get_context()->fuse;
+	view_map_start(&state->views);
+	flusher_start(&state->flusher);
+	trace_start();
+
+	return state;
+}
+
+static void fmapfs_destroy(void *private_data)
+{
+	struct fmapfs_state *state = private_data;
+
+	view_map_stop(&state->views);
+	flusher_stop(&state->flusher);
+	trace_stop();
+}
+
+/*
+ * The path handlers, for a path within the given image.  The session's
+ * handlers below call them with its only image.
+ */
+int fmapfs_image_getattr(struct fmapfs_state *state, const char *path,
+			 struct stat *st)
+{
 	struct directory_entry *entry;
 
-	entry = route_lookup_path(state->rootdir, path);
+	entry = route_lookup_indexed(&state->paths, state->rootdir, path);
 	if (!entry) {
-		fuse_log(FUSE_LOG_ERR, "Route not found for %s", path);
+		fmapfs_log(FUSE_LOG_ERR, "Route not found for %s", path);
 		return -ENOENT;
 	}
 
-	fill_statbuf_with_dirent(entry, st);
+	route_fill_stat(entry, st);
 
 	return 0;
 }
 
-static int fmapfs_readdir(const char *path, void *buffer,
-			  fuse_fill_dir_t filler, off_t offset,
-			  struct fuse_file_info *fi,
-			  enum fuse_readdir_flags flags)
+int fmapfs_image_opendir(struct fmapfs_state *state, const char *path,
+			 struct fuse_file_info *fi)
 {
-	struct fmapfs_state *state = fuse_get_context()->private_data;
 	struct directory_entry *entry;
 
-	entry = route_lookup_path(state->rootdir, path);
+	entry = route_lookup_indexed(&state->paths, state->rootdir, path);
 	if (!entry) {
-		fuse_log(FUSE_LOG_ERR, "Route not found for %s", path);
+		fmapfs_log(FUSE_LOG_ERR, "Route not found for %s", path);
 		return -ENOENT;
 	}
 
 	if (!S_ISDIR(entry->mode)) {
-		fuse_log(FUSE_LOG_ERR, "%s is not a directory", path);
+		fmapfs_log(FUSE_LOG_ERR, "%s is not a directory", path);
 		return -ENOTDIR;
 	}
 
-	filler(buffer, ".", NULL, 0, 0);
-	filler(buffer, "..", NULL, 0, 0);
-
-	for (struct dir_list *ent = entry->dir->entries; ent; ent = ent->next) {
-		if (flags & FUSE_FILL_DIR_PLUS) {
-			struct stat statbuf;
-
-			fill_statbuf_with_dirent(ent->entry, &statbuf);
-			filler(buffer, ent->entry->name, &statbuf, 0,
-			       FUSE_FILL_DIR_PLUS);
-		} else {
-			filler(buffer, ent->entry->name, NULL, 0, 0);
-		}
-	}
-
-	return 0;
+	return handle_new(state, entry, fi);
 }
 
-static int fmapfs_open(const char *path, struct fuse_file_info *fi)
+int fmapfs_image_open(struct fmapfs_state *state, const char *path,
+		      struct fuse_file_info *fi)
 {
-	struct fmapfs_state *state = fuse_get_context()->private_data;
 	struct directory_entry *entry;
 	mode_t accmode;
+	int rv;
 
-	entry = route_lookup_path(state->rootdir, path);
+	entry = route_lookup_indexed(&state->paths, state->rootdir, path);
 	if (!entry) {
-		fuse_log(FUSE_LOG_ERR, "Route not found for %s", path);
+		fmapfs_log(FUSE_LOG_ERR, "Route not found for %s", path);
 		return -ENOENT;
 	}
 
 	if (!S_ISREG(entry->mode)) {
-		fuse_log(FUSE_LOG_ERR, "%s is not a regular file", path);
+		fmapfs_log(FUSE_LOG_ERR, "%s is not a regular file", path);
 		return -EISDIR;
 	}
 
 	accmode = fi->flags & O_ACCMODE;
 
-	if ((accmode & O_RDONLY) && !entry->reg_file.ops->read) {
-		fuse_log(FUSE_LOG_ERR, "No read operation on %s", path);
+	if (accmode != O_WRONLY && !entry->reg_file.ops->read) {
+		fmapfs_log(FUSE_LOG_ERR, "No read operation on %s", path);
 		return -EACCES;
 	}
 
-	if ((accmode & O_WRONLY) && !entry->reg_file.ops->write) {
-		fuse_log(FUSE_LOG_ERR, "No write operation on %s", path);
+	if (accmode != O_RDONLY && !entry->reg_file.ops->write) {
+		fmapfs_log(FUSE_LOG_ERR, "No write operation on %s", path);
 		return -EACCES;
 	}
 
+	fi->keep_cache = state->opts.keep_cache &&
+			 entry->reg_file.ops->keep_cache;
+	fi->direct_io = entry->reg_file.ops->direct_io;
+
+	rv = handle_new(state, entry, fi);
+	if (rv < 0)
+		return rv;
+
+	rv = route_open_file((struct open_file *)(uintptr_t)fi->fh);
+	if (rv < 0)
+		handle_free(fi);
+
+	return rv;
+}
+
+static int fmapfs_getattr(const char *path, struct stat *st,
+			  struct fuse_file_info *fi)
+{
+	if (fi && fi->fh) {
+		route_fill_stat(handle_entry(fi), st);
+		return 0;
+	}
+
+	return fmapfs_image_getattr(fuse_get_context()->private_data, path, st);
+}
+
+static int fmapfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fmapfs_image_opendir(fuse_get_context()->private_data, path, fi);
+}
+
+/*
+ * Offsets are entry indices, as in the low-level engine: 0 is ".", 1 is
+ * "..", and the children follow in route order.  Each entry is given the
+ * offset of the entry after it, so a listing that fills the kernel's
+ * buffer resumes where it stopped instead of starting over.
+ */
+static int fmapfs_readdir(const char *path, void *buffer,
+			  fuse_fill_dir_t filler, off_t offset,
+			  struct fuse_file_info *fi,
+			  enum fuse_readdir_flags flags)
+{
+	struct directory_entry *entry = handle_entry(fi);
+	struct directory *dir = route_get_dir(entry);
+
+	for (off_t idx = offset; idx < 2 + (off_t)dir->n_children; idx++) {
+		struct directory_entry *child;
+		struct stat statbuf;
+		int full;
+
+		if (idx < 2) {
+			full = filler(buffer, idx ? ".." : ".", NULL, idx + 1,
+				      0);
+		} else {
+			child = dir->children[idx - 2];
+			if (flags & FUSE_READDIR_PLUS) {
+				route_fill_stat(child, &statbuf);
+				full = filler(buffer, child->name, &statbuf,
+					      idx + 1, FUSE_FILL_DIR_PLUS);
+			} else {
+				full = filler(buffer, child->name, NULL,
+					      idx + 1, 0);
+			}
+		}
+
+		if (full)
+			break;
+	}
+
+	return 0;
+}
+
+static int fmapfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	handle_free(fi);
+	return 0;
+}
+
+static int fmapfs_open(const char *path, struct fuse_file_info *fi)
+{
+	return fmapfs_image_open(fuse_get_context()->private_data, path, fi);
+}
+
+static int fmapfs_release(const char *path, struct fuse_file_info *fi)
+{
+	route_release_file((struct open_file *)(uintptr_t)fi->fh);
+	handle_free(fi);
 	return 0;
 }
 
 static int fmapfs_read(const char *path, char *buf, size_t n_bytes,
 		       off_t offset, struct fuse_file_info *fi)
 {
-	struct fmapfs_state *state = fuse_get_context()->private_data;
-	struct directory_entry *entry;
+	struct directory_entry *entry = handle_entry(fi);
+	uint64_t locked;
+	int rv;
 
-	entry = route_lookup_path(state->rootdir, path);
-	if (!entry) {
-		fuse_log(FUSE_LOG_ERR, "Route not found for %s", path);
-		return -ENOENT;
+	if (!entry->reg_file.ops->read) {
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support reading",
+			   entry->name);
+		return -EOPNOTSUPP;
 	}
 
-	if (!S_ISREG(entry->mode)) {
-		fuse_log(FUSE_LOG_ERR, "%s is not a regular file", path);
-		return -EISDIR;
+	locked = view_lock(entry->reg_file.view, offset, n_bytes, false);
+	rv = TRACE_CALL(STATS_FILE_READ, entry, offset, n_bytes,
+			entry->reg_file.ops->read(buf, n_bytes, offset, fi,
+						  entry->reg_file.param));
+	view_unlock(entry->reg_file.view, locked);
+
+	return rv;
+}
+
+/*
+ * libfuse frees memory buffers returned from read_buf, so mapped memory
+ * can't be handed back directly.  For files that can be read from the
+ * image descriptor, reply with a descriptor-backed buffer instead, which
+ * lets the kernel copy (or splice) straight from the page cache.
+ *
+ * The copy happens after we return, so such reads aren't serialized
+ * against writes to the same bytes, just like reads of the image file.
+ */
+static int fmapfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			   size_t n_bytes, off_t offset,
+			   struct fuse_file_info *fi)
+{
+	struct directory_entry *entry = handle_entry(fi);
+	struct fuse_buf buf = { .fd = -1 };
+	struct fuse_bufvec *bufv;
+	int rv;
+
+	bufv = malloc(sizeof(*bufv));
+	if (!bufv)
+		return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(n_bytes);
+
+	if (entry->reg_file.ops->read_buf) {
+		rv = TRACE_CALL(STATS_FILE_READ_BUF, entry, offset, n_bytes,
+				entry->reg_file.ops->read_buf(
+					&buf, n_bytes, offset, fi,
+					entry->reg_file.param));
+		if (rv < 0) {
+			free(bufv);
+			return rv;
+		}
+
+		if (buf.fd >= 0) {
+			bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			bufv->buf[0].fd = buf.fd;
+			bufv->buf[0].pos = buf.pos;
+			bufv->buf[0].size = rv;
+			*bufp = bufv;
+			return 0;
+		}
 	}
 
-	if (!entry->reg_file.ops->read) {
-		fuse_log(FUSE_LOG_ERR, "%s does not support reading", path);
-		return -EOPNOTSUPP;
+	bufv->buf[0].mem = malloc(n_bytes);
+	if (!bufv->buf[0].mem) {
+		free(bufv);
+		return -ENOMEM;
 	}
 
-	return entry->reg_file.ops->read(buf, n_bytes, offset, fi,
-					 entry->reg_file.param);
+	rv = fmapfs_read(path, bufv->buf[0].mem, n_bytes, offset, fi);
+	if (rv < 0) {
+		free(bufv->buf[0].mem);
+		free(bufv);
+		return rv;
+	}
+
+	bufv->buf[0].size = rv;
+	*bufp = bufv;
+	return 0;
 }
 
 static int fmapfs_write(const char *path, const char *buf, size_t n_bytes,
 			off_t offset, struct fuse_file_info *fi)
 {
-	struct fmapfs_state *state = fuse_get_context()->private_data;
-	struct directory_entry *entry;
+	struct fmapfs_state *state = fmapfs_handle_state(fi);
+	struct directory_entry *entry = handle_entry(fi);
+	uint64_t locked;
+	int rv;
 
-	entry = route_lookup_path(state->rootdir, path);
-	if (!entry) {
-		fuse_log(FUSE_LOG_ERR, "Route not found for %s", path);
-		return -ENOENT;
+	if (!entry->reg_file.ops->write) {
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support writing",
+			   entry->name);
+		return -EOPNOTSUPP;
 	}
 
-	if (!S_ISREG(entry->mode)) {
-		fuse_log(FUSE_LOG_ERR, "%s is not a regular file", path);
-		return -EISDIR;
-	}
+	locked = view_lock(entry->reg_file.view, offset, n_bytes, true);
+	rv = TRACE_CALL(STATS_FILE_WRITE, entry, offset, n_bytes,
+			entry->reg_file.ops->write(buf, n_bytes, offset, fi,
+						   entry->reg_file.param));
+	view_unlock(entry->reg_file.view, locked);
+	if (rv > 0)
+		rv = fmapfs_written(state, fi, offset, rv) ?: rv;
+
+	return rv;
+}
+
+static int fmapfs_write_buf(const char *path, struct fuse_bufvec *buf,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fmapfs_handle_state(fi);
+	struct directory_entry *entry = handle_entry(fi);
+	uint64_t locked;
+	int rv;
 
 	if (!entry->reg_file.ops->write) {
-		fuse_log(FUSE_LOG_ERR, "%s does not support writing", path);
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support writing",
+			   entry->name);
 		return -EOPNOTSUPP;
 	}
 
-	return entry->reg_file.ops->write(buf, n_bytes, offset, fi,
-					  entry->reg_file.param);
+	locked = view_lock(entry->reg_file.view, offset, fuse_buf_size(buf),
+			   true);
+	rv = route_write_buf(entry, buf, offset, fi);
+	view_unlock(entry->reg_file.view, locked);
+	if (rv > 0)
+		rv = fmapfs_written(state, fi, offset, rv) ?: rv;
+
+	return rv;
+}
+
+/* Every close() of the file, unlike release which comes only once */
+static int fmapfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fmapfs_handle_state(fi);
+
+	return fmapfs_closed(state, fi);
+}
+
+/* The image has no metadata of its own, so datasync changes nothing */
+static int fmapfs_fsync(const char *path, int datasync,
+			struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fmapfs_handle_state(fi);
+
+	return flusher_fsync(&state->flusher);
+}
+
+/*
+ * Entry points, timed and counted for .fmapfs/stats.  Handlers returning
+ * a byte count record it as the bytes moved.
+ */
+static int timed_getattr(const char *path, struct stat *st,
+			 struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_GETATTR, fmapfs_getattr(path, st, fi));
+}
+
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_OPENDIR, fmapfs_opendir(path, fi));
+}
+
+static int timed_readdir(const char *path, void *buffer,
+			 fuse_fill_dir_t filler, off_t offset,
+			 struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	return STATS_CALL(STATS_READDIR, fmapfs_readdir(path, buffer, filler,
+							offset, fi, flags));
+}
+
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_RELEASEDIR, fmapfs_releasedir(path, fi));
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_OPEN, fmapfs_open(path, fi));
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_RELEASE, fmapfs_release(path, fi));
+}
+
+static int timed_read(const char *path, char *buf, size_t n_bytes,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_READ,
+			  fmapfs_read(path, buf, n_bytes, offset, fi));
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp,
+			  size_t n_bytes, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	uint64_t start = stats_start();
+	int rv = fmapfs_read_buf(path, bufp, n_bytes, offset, fi);
+
+	stats_end(STATS_READ_BUF, start, rv < 0 ? rv : fuse_buf_size(*bufp));
+	return rv;
+}
+
+static int timed_write(const char *path, const char *buf, size_t n_bytes,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_WRITE,
+			  fmapfs_write(path, buf, n_bytes, offset, fi));
+}
+
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_WRITE_BUF,
+			  fmapfs_write_buf(path, buf, offset, fi));
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_FLUSH, fmapfs_flush(path, fi));
+}
+
+static int timed_fsync(const char *path, int datasync,
+		       struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_FSYNC, fmapfs_fsync(path, datasync, fi));
 }
 
 const struct fuse_operations fmapfs_ops = {
-	.getattr = fmapfs_getattr,
-	.readdir = fmapfs_readdir,
-	.open = fmapfs_open,
-	.read = fmapfs_read,
-	.write = fmapfs_write,
+	.init = fmapfs_init,
+	.destroy = fmapfs_destroy,
+	.getattr = timed_getattr,
+	.opendir = timed_opendir,
+	.readdir = timed_readdir,
+	.releasedir = timed_releasedir,
+	.open = timed_open,
+	.release = timed_release,
+	.read = timed_read,
+	.read_buf = timed_read_buf,
+	.write = timed_write,
+	.write_buf = timed_write_buf,
+	.flush = timed_flush,
+	.fsync = timed_fsync,
 };
@@ -1,14 +1,15 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <fuse_log.h>
-
 #include "arena.h"
 #include "array_size.h"
 #include "boolean_flag_file.h"
 #include "gbb.h"
+#include "image.h"
+#include "log.h"
 #include "route.h"
 #include "str_file.h"
 
@@ -64,38 +65,49 @@ _Static_assert(sizeof(struct gbb_header) == 128,
 	       "GBB header should be 128 bytes in size");
 
 int setup_gbb_files(struct arena *arena, struct directory *basedir,
-		    void *gbb_mem, size_t gbb_size)
+		    struct image *image, off_t gbb_offset, size_t gbb_size)
 {
-	struct gbb_header *header;
+	struct gbb_header header;
 	struct directory *gbb_dir;
 	struct directory *flags_dir;
+	off_t flags_offset;
 
 	if (gbb_size < sizeof(struct gbb_header)) {
-		fuse_log(FUSE_LOG_ERR,
-			 "GBB area is too small to be a GBB partition");
+		fmapfs_log(FUSE_LOG_ERR,
+			   "GBB area is too small to be a GBB partition");
+		return -1;
+	}
+
+	if (image_read(image, &header, sizeof(header), gbb_offset) < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Failed to read the GBB header");
 		return -1;
 	}
 
-	if (strncmp((const char *)gbb_mem, GBB_SIGNATURE,
+	if (strncmp((const char *)header.signature, GBB_SIGNATURE,
 		    __builtin_strlen(GBB_SIGNATURE))) {
-		fuse_log(FUSE_LOG_ERR, "GBB header has invalid signature");
+		fmapfs_log(FUSE_LOG_ERR, "GBB header has invalid signature");
+		return -1;
+	}
+
+	if (header.hwid.offset > gbb_size ||
+	    header.hwid.size > gbb_size - header.hwid.offset) {
+		fmapfs_log(FUSE_LOG_ERR, "GBB HWID lies outside the GBB area");
 		return -1;
 	}
 
-	header = gbb_mem;
 	gbb_dir = route_new_subdirectory(arena, basedir, "gbb-data");
 	flags_dir = route_new_subdirectory(arena, gbb_dir, "flags");
 
+	flags_offset = gbb_offset + offsetof(struct gbb_header, flags);
 	for (size_t i = 0; i < ARRAY_SIZE(gbb_flags); i++) {
 		add_boolean_flag_file(arena, flags_dir, gbb_flags[i].filename,
-				      &header->flags, gbb_flags[i].bit);
+				      image, flags_offset, gbb_flags[i].bit);
 	}
 
-	add_str_file(arena, gbb_dir, "hwid",
-		     (char *)gbb_mem + header->hwid.offset, header->hwid.size,
-		     true);
+	add_str_file(arena, gbb_dir, "hwid", image,
+		     gbb_offset + header.hwid.offset, header.hwid.size, true);
 
-	fuse_log(FUSE_LOG_INFO, "GBB format detected and setup");
+	fmapfs_log(FUSE_LOG_INFO, "GBB format detected and setup");
 
 	return 0;
 }
@@ -0,0 +1,586 @@
+/* O_DIRECT */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "image_uring.h"
+#include "log.h"
+#include "stats.h"
+
+/* Alignment assumed for O_DIRECT when there's no block device to ask */
+#define IMAGE_DIRECT_ALIGN 4096
+
+static size_t image_dirty_words(struct image *image)
+{
+	size_t n_pages = (image->size >> IMAGE_DIRTY_SHIFT) + 1;
+
+	return (n_pages + 63) / 64;
+}
+
+void image_mark_dirty(struct image *image, off_t offset, size_t n_bytes)
+{
+	size_t first = offset >> IMAGE_DIRTY_SHIFT;
+	size_t last = (offset + n_bytes - 1) >> IMAGE_DIRTY_SHIFT;
+
+	if (!n_bytes)
+		return;
+
+	for (size_t page = first; page <= last; page++) {
+		uint64_t bit = UINT64_C(1) << (page % 64);
+
+		__atomic_fetch_or(&image->dirty[page / 64], bit,
+				  __ATOMIC_RELAXED);
+		if (!(__atomic_load_n(&image->changed[page / 64],
+				      __ATOMIC_RELAXED) & bit))
+			__atomic_fetch_or(&image->changed[page / 64], bit,
+					  __ATOMIC_RELAXED);
+	}
+
+	/* Seen by the next flush, which clears it before taking the bits */
+	__atomic_store_n(&image->any_dirty, true, __ATOMIC_RELEASE);
+}
+
+bool image_changed(struct image *image, off_t offset, size_t n_bytes)
+{
+	size_t first = offset >> IMAGE_DIRTY_SHIFT;
+	size_t last;
+
+	if (offset >= image->size || !n_bytes)
+		return false;
+	if (n_bytes > image->size - offset)
+		n_bytes = image->size - offset;
+	last = (offset + n_bytes - 1) >> IMAGE_DIRTY_SHIFT;
+
+	for (size_t page = first; page <= last; page++)
+		if (__atomic_load_n(&image->changed[page / 64],
+				    __ATOMIC_RELAXED) &
+		    (UINT64_C(1) << (page % 64)))
+			return true;
+
+	return false;
+}
+
+/*
+ * Flush the pages [first, end), marking them dirty again on failure.
+ * Counted in .fmapfs/stats even when only the sync makes them durable.
+ */
+static int image_flush_run(struct image *image, size_t first, size_t end,
+			   bool wait)
+{
+	off_t offset = (off_t)first << IMAGE_DIRTY_SHIFT;
+	size_t n_bytes = (end - first) << IMAGE_DIRTY_SHIFT;
+	uint64_t start = stats_start();
+	int rv = 0;
+
+	if (offset + n_bytes > image->size)
+		n_bytes = image->size - offset;
+
+	if (image->ops->flush)
+		rv = image->ops->flush(image, offset, n_bytes, wait);
+	if (rv < 0 && wait)
+		image_mark_dirty(image, offset, n_bytes);
+
+	stats_end(STATS_FLUSH_RUN, start, rv < 0 ? rv : (int64_t)n_bytes);
+	return rv;
+}
+
+/* The bits of word i for the pages [first, end) */
+static uint64_t image_page_mask(size_t i, size_t first, size_t end)
+{
+	size_t lo = first > i * 64 ? first - i * 64 : 0;
+	size_t hi = end < (i + 1) * 64 ? end - i * 64 : 64;
+	uint64_t mask = hi < 64 ? (UINT64_C(1) << hi) - 1 : ~UINT64_C(0);
+
+	return mask & ~((UINT64_C(1) << lo) - 1);
+}
+
+/*
+ * The dirty bits of word i under mask, taking them when the flush makes
+ * them clean.
+ */
+static uint64_t image_dirty_take(struct image *image, size_t i,
+				 uint64_t mask, bool wait)
+{
+	if (wait)
+		return __atomic_fetch_and(&image->dirty[i], ~mask,
+					  __ATOMIC_ACQ_REL) &
+		       mask;
+
+	return __atomic_load_n(&image->dirty[i], __ATOMIC_ACQUIRE) & mask;
+}
+
+/* Flush the dirty pages among [first, end) */
+static int image_flush_pages(struct image *image, size_t first, size_t end,
+			     bool wait)
+{
+	bool whole = !first && end == image_dirty_words(image) * 64;
+	size_t run_start = 0;
+	bool in_run = false;
+	uint64_t bits = 0;
+	uint64_t mask;
+	int rv = 0;
+
+	if (!image->dirty || first >= end)
+		return 0;
+
+	/* Serialized, so a waiting flush doesn't race one that took bits */
+	pthread_mutex_lock(&image->flush_lock);
+	if (!__atomic_load_n(&image->any_dirty, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&image->flush_lock);
+		return 0;
+	}
+	if (wait && whole)
+		__atomic_store_n(&image->any_dirty, false, __ATOMIC_SEQ_CST);
+
+	/* One past the end, to close the last run */
+	for (size_t page = first; page <= end; page++) {
+		bool dirty;
+		int err;
+
+		if (page < end && (page == first || page % 64 == 0)) {
+			mask = image_page_mask(page / 64, first, end);
+			bits = image_dirty_take(image, page / 64, mask, wait);
+		}
+		dirty = page < end && bits & (UINT64_C(1) << (page % 64));
+
+		if (dirty && !in_run) {
+			run_start = page;
+			in_run = true;
+		} else if (!dirty && in_run) {
+			in_run = false;
+			err = image_flush_run(image, run_start, page, wait);
+			if (err < 0 && !rv)
+				rv = err;
+		}
+	}
+
+	if (wait && image->ops->sync && !rv)
+		rv = image->ops->sync(image);
+	pthread_mutex_unlock(&image->flush_lock);
+
+	if (rv < 0)
+		fmapfs_log(FUSE_LOG_ERR, "Flushing the image failed: %s",
+			   strerror(-rv));
+
+	return rv;
+}
+
+int image_flush(struct image *image, bool wait)
+{
+	return image_flush_pages(image, 0, image_dirty_words(image) * 64,
+				 wait);
+}
+
+int image_flush_range(struct image *image, off_t offset, size_t n_bytes,
+		      bool wait)
+{
+	size_t first = offset >> IMAGE_DIRTY_SHIFT;
+	size_t last;
+
+	if (offset < 0 || offset >= image->size || !n_bytes)
+		return 0;
+	if (n_bytes > image->size - offset)
+		n_bytes = image->size - offset;
+	last = (offset + n_bytes - 1) >> IMAGE_DIRTY_SHIFT;
+
+	return image_flush_pages(image, first, last + 1, wait);
+}
+
+static ssize_t fd_seek_size(int fd)
+{
+	ssize_t file_size;
+
+	file_size = lseek(fd, 0, SEEK_END);
+	if (file_size < 0)
+		return -1;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	return file_size;
+}
+
+/* Devices may transfer less than asked, so loop until done */
+static ssize_t fd_read(int fd, void *buf, size_t n_bytes, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < n_bytes) {
+		ssize_t rv = pread(fd, buf + done, n_bytes - done,
+				   offset + done);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			return -errno;
+		if (!rv)
+			return -EIO;
+		done += rv;
+	}
+
+	return done;
+}
+
+static ssize_t fd_write(int fd, const void *buf, size_t n_bytes,
+			off_t offset)
+{
+	size_t done = 0;
+
+	while (done < n_bytes) {
+		ssize_t rv = pwrite(fd, buf + done, n_bytes - done,
+				    offset + done);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			return -errno;
+		if (!rv)
+			return -EIO;
+		done += rv;
+	}
+
+	return done;
+}
+
+static ssize_t mmap_read(struct image *image, void *buf, size_t n_bytes,
+			 off_t offset)
+{
+	memcpy(buf, image->mem + offset, n_bytes);
+	return n_bytes;
+}
+
+static ssize_t mmap_write(struct image *image, const void *buf,
+			  size_t n_bytes, off_t offset)
+{
+	memcpy(image->mem + offset, buf, n_bytes);
+	return n_bytes;
+}
+
+/* The kernel tracks dirty pages itself, MS_ASYNC merely asks for them */
+static int mmap_flush(struct image *image, off_t offset, size_t n_bytes,
+		      bool wait)
+{
+	uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	uintptr_t start = (uintptr_t)(image->mem + offset) & ~page_mask;
+	uintptr_t end = (uintptr_t)(image->mem + offset) + n_bytes;
+
+	if (msync((void *)start, end - start, wait ? MS_SYNC : MS_ASYNC) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static const struct image_ops mmap_ops = {
+	.read = mmap_read,
+	.write = mmap_write,
+	.flush = mmap_flush,
+};
+
+static ssize_t pread_read(struct image *image, void *buf, size_t n_bytes,
+			  off_t offset)
+{
+	return fd_read(image->fd, buf, n_bytes, offset);
+}
+
+static ssize_t pread_write(struct image *image, const void *buf,
+			   size_t n_bytes, off_t offset)
+{
+	return fd_write(image->fd, buf, n_bytes, offset);
+}
+
+/* Ranges reach the device here, and the sync flushes its cache */
+static int pread_flush(struct image *image, off_t offset, size_t n_bytes,
+		       bool wait)
+{
+	unsigned int flags = SYNC_FILE_RANGE_WRITE;
+
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE |
+			 SYNC_FILE_RANGE_WAIT_AFTER;
+
+	/* Character devices can't, but don't cache writes anyway */
+	if (sync_file_range(image->fd, offset, n_bytes, flags) < 0 &&
+	    errno != ESPIPE && errno != EINVAL)
+		return -errno;
+
+	return 0;
+}
+
+static int pread_sync(struct image *image)
+{
+	if (fdatasync(image->fd) < 0 && errno != EINVAL)
+		return -errno;
+
+	return 0;
+}
+
+static const struct image_ops pread_ops = {
+	.read = pread_read,
+	.write = pread_write,
+	.flush = pread_flush,
+	.sync = pread_sync,
+};
+
+/*
+ * O_DIRECT moves whole aligned blocks to and from aligned buffers.  Other
+ * requests go through a bounce buffer, and writes of partial blocks read
+ * them first.  A block never spans two view lock chunks, so view locks
+ * keep writers to neighbouring bytes from undoing each other.
+ */
+static bool direct_aligned(struct image *image, const void *buf,
+			   size_t n_bytes, off_t offset)
+{
+	return !(((uintptr_t)buf | n_bytes | offset) & (image->align - 1));
+}
+
+static ssize_t direct_read(struct image *image, void *buf, size_t n_bytes,
+			   off_t offset)
+{
+	size_t mask = image->align - 1;
+	off_t start = offset & ~mask;
+	size_t len = (offset + n_bytes - start + mask) & ~mask;
+	void *bounce;
+	ssize_t rv;
+
+	if (direct_aligned(image, buf, n_bytes, offset))
+		return fd_read(image->direct_fd, buf, n_bytes, offset);
+
+	if (posix_memalign(&bounce, image->align, len))
+		return -ENOMEM;
+
+	rv = fd_read(image->direct_fd, bounce, len, start);
+	if (rv >= 0) {
+		memcpy(buf, bounce + (offset - start), n_bytes);
+		rv = n_bytes;
+	}
+
+	free(bounce);
+	return rv;
+}
+
+static ssize_t direct_write(struct image *image, const void *buf,
+			    size_t n_bytes, off_t offset)
+{
+	size_t mask = image->align - 1;
+	off_t start = offset & ~mask;
+	size_t len = (offset + n_bytes - start + mask) & ~mask;
+	bool head = offset != start;
+	bool tail = (offset + n_bytes) & mask;
+	void *bounce;
+	ssize_t rv = 0;
+
+	if (direct_aligned(image, buf, n_bytes, offset))
+		return fd_write(image->direct_fd, buf, n_bytes, offset);
+
+	if (posix_memalign(&bounce, image->align, len))
+		return -ENOMEM;
+
+	/* Keep the bytes around the write in its first and last blocks */
+	if (head)
+		rv = fd_read(image->direct_fd, bounce, image->align, start);
+	if (rv >= 0 && tail && !(head && len == image->align))
+		rv = fd_read(image->direct_fd, bounce + len - image->align,
+			     image->align, start + len - image->align);
+
+	if (rv >= 0) {
+		memcpy(bounce + (offset - start), buf, n_bytes);
+		rv = fd_write(image->direct_fd, bounce, len, start);
+	}
+
+	free(bounce);
+	return rv < 0 ? rv : n_bytes;
+}
+
+/* Writes are already on the device, if maybe only in its cache */
+static int direct_sync(struct image *image)
+{
+	if (fdatasync(image->direct_fd) < 0 && errno != EINVAL)
+		return -errno;
+
+	return 0;
+}
+
+static const struct image_ops direct_ops = {
+	.read = direct_read,
+	.write = direct_write,
+	.sync = direct_sync,
+};
+
+static size_t direct_align(int fd, struct stat *st)
+{
+	int block_size;
+
+	if (S_ISBLK(st->st_mode) && !ioctl(fd, BLKSSZGET, &block_size))
+		return block_size;
+
+	return IMAGE_DIRECT_ALIGN;
+}
+
+static int direct_open(struct image *image, const char *path, int fd,
+		       struct stat *st)
+{
+	image->align = direct_align(fd, st);
+
+	/* Blocks past the end can't be written without growing the file */
+	if (image->size % image->align) {
+		fmapfs_log(FUSE_LOG_ERR,
+			   "%s isn't a whole number of %zu byte blocks", path,
+			   image->align);
+		return -1;
+	}
+
+	image->direct_fd = open(path, O_RDWR | O_DIRECT);
+	if (image->direct_fd < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to open %s for direct I/O: %s",
+			   path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef FMAPFS_IO_URING
+/*
+ * The ring goes around the page cache too when the image allows O_DIRECT,
+ * and through it otherwise.  Either way, it gets the only descriptor.
+ */
+static int uring_open(struct image *image, const char *path, int fd,
+		      struct stat *st)
+{
+	int direct_fd = -1;
+
+	image->align = direct_align(fd, st);
+	if (!(image->size % image->align))
+		direct_fd = open(path, O_RDWR | O_DIRECT);
+
+	if (direct_fd < 0) {
+		fmapfs_log(FUSE_LOG_INFO,
+			   "Using buffered I/O for %s, O_DIRECT isn't possible",
+			   path);
+		image->align = 1;
+		return image_uring_open(image, fd);
+	}
+
+	if (image_uring_open(image, direct_fd) < 0) {
+		close(direct_fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+#endif
+
+int image_open(struct image *image, const char *path, const char *backend)
+{
+	struct stat st;
+	ssize_t size;
+	int fd;
+
+	*image = (struct image){ .fd = -1, .direct_fd = -1 };
+	pthread_mutex_init(&image->flush_lock, NULL);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to open %s: %s", path,
+			   strerror(errno));
+		return -1;
+	}
+
+	/* lseek() also sizes block and MTD devices, unlike fstat() */
+	size = fd_seek_size(fd);
+	if (fstat(fd, &st) < 0 || size < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to get the size of %s: %s",
+			   path, strerror(errno));
+		goto fail;
+	}
+	image->size = size;
+
+	image->dirty = calloc(image_dirty_words(image), sizeof(uint64_t));
+	image->changed = calloc(image_dirty_words(image), sizeof(uint64_t));
+	if (!image->dirty || !image->changed)
+		goto fail;
+
+	/* Character devices like MTD can't be mapped */
+	if (!backend)
+		backend = S_ISREG(st.st_mode) ? "mmap" : "pread";
+
+	if (!strcmp(backend, "mmap")) {
+		image->mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, fd, 0);
+		if (image->mem == MAP_FAILED) {
+			fmapfs_log(FUSE_LOG_ERR, "Failed to mmap %s: %s", path,
+				   strerror(errno));
+			image->mem = NULL;
+			goto fail;
+		}
+		image->ops = &mmap_ops;
+	} else if (!strcmp(backend, "pread")) {
+		image->ops = &pread_ops;
+	} else if (!strcmp(backend, "direct")) {
+		if (direct_open(image, path, fd, &st) < 0)
+			goto fail;
+
+		/* Nothing may bypass O_DIRECT through the page cache */
+		close(fd);
+		fd = -1;
+		image->ops = &direct_ops;
+#ifdef FMAPFS_IO_URING
+	} else if (!strcmp(backend, "uring")) {
+		if (uring_open(image, path, fd, &st) < 0)
+			goto fail;
+
+		/* All I/O goes through the ring, nothing is spliced */
+		fd = -1;
+#endif
+	} else {
+		fmapfs_log(FUSE_LOG_ERR, "Unknown image backend %s", backend);
+		goto fail;
+	}
+
+	fmapfs_log(FUSE_LOG_DEBUG, "Opened %s with the %s backend", path,
+		   backend);
+	image->backend = backend;
+	image->fd = fd;
+	return 0;
+
+fail:
+	free(image->dirty);
+	free(image->changed);
+	image->dirty = NULL;
+	pthread_mutex_destroy(&image->flush_lock);
+	close(fd);
+	return -1;
+}
+
+void image_close(struct image *image)
+{
+	/* Whatever is still dirty; failures are logged, and can't be helped */
+	image_flush(image, true);
+
+#ifdef FMAPFS_IO_URING
+	if (image->uring)
+		image_uring_close(image);
+#endif
+	if (image->mem)
+		munmap(image->mem, image->size);
+	if (image->fd >= 0)
+		close(image->fd);
+	if (image->direct_fd >= 0)
+		close(image->direct_fd);
+	free(image->dirty);
+	free(image->changed);
+	pthread_mutex_destroy(&image->flush_lock);
+}
@@ -0,0 +1,607 @@
+/* sync_file_range() flags */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "image_uring.h"
+#include "log.h"
+
+/*
+ * FUSE workers queue their reads and writes on one ring shared by the
+ * whole image.  Whichever of them gets to io_uring_submit() first submits
+ * everything queued so far, so concurrent requests reach the kernel in
+ * batches rather than one system call each.  A reaper thread hands the
+ * completions back to the workers waiting on them.
+ *
+ * Requests that O_DIRECT can't take as they are, which is most of them
+ * since FUSE buffers aren't block aligned, are staged in buffers
+ * registered with the ring, so the kernel doesn't map and pin them on
+ * every request.
+ */
+
+/* Requests queued before a worker has to submit to get a slot */
+#define URING_ENTRIES 256
+
+/* Registered staging buffers, each large enough for a FUSE read */
+#define URING_BUFS 32
+#define URING_BUF_SIZE (128 << 10)
+
+/* Largest transfer in one request, as lengths are 32 bits */
+#define URING_MAX_TRANSFER (1u << 30)
+
+/* Submissions refused with nothing in flight, a millisecond apart */
+#define URING_SUBMIT_RETRIES 8
+
+struct image_uring {
+	struct io_uring ring;
+	int fd;
+	bool fixed_file;
+
+	/* Serializes queueing and submitting, not waiting */
+	pthread_mutex_t sq_lock;
+	pthread_t reaper;
+
+	/* Broadcast by the reaper, under sq_lock, as completions drain */
+	pthread_cond_t reaped;
+
+	/* Requests not completed yet, and how many the kernel has */
+	struct uring_req *pending;
+	unsigned int in_flight;
+
+	/* Set once the ring fails for good, failing every request */
+	int error;
+
+	/* Staging buffers, and a stack of the free ones */
+	pthread_mutex_t buf_lock;
+	uint8_t *bufs;
+	bool fixed_bufs;
+	int free_bufs[URING_BUFS];
+	int n_free;
+};
+
+/* A request in flight, on the stack of the worker waiting for it */
+struct uring_req {
+	sem_t done;
+	int res;
+
+	/* In image_uring.pending, under sq_lock */
+	struct uring_req *next;
+	struct uring_req **pprev;
+};
+
+/* Both called with sq_lock held */
+static void uring_complete(struct uring_req *req, int res)
+{
+	*req->pprev = req->next;
+	if (req->next)
+		req->next->pprev = req->pprev;
+
+	/* The waiter may return as soon as it's posted */
+	req->res = res;
+	sem_post(&req->done);
+}
+
+static void uring_fail(struct image_uring *u, int error)
+{
+	/* Not one uring_transfer() retries, as the ring is gone for good */
+	if (error == -EAGAIN || error == -EINTR)
+		error = -EIO;
+
+	u->error = error;
+	while (u->pending)
+		uring_complete(u->pending, error);
+	u->in_flight = 0;
+	pthread_cond_broadcast(&u->reaped);
+}
+
+/*
+ * Only cancelled while waiting, by image_uring_close() when the ring has
+ * failed, so it never goes holding sq_lock.
+ */
+static int uring_reap_wait(struct image_uring *u, struct io_uring_cqe **cqe)
+{
+	int rv;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	rv = io_uring_wait_cqe(&u->ring, cqe);
+	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	return rv;
+}
+
+static void *uring_reap(void *arg)
+{
+	struct image_uring *u = arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		unsigned int head;
+		unsigned int n = 0;
+		bool stop = false;
+		int rv;
+
+		rv = uring_reap_wait(u, &cqe);
+		if (rv == -EINTR || rv == -EAGAIN)
+			continue;
+
+		pthread_mutex_lock(&u->sq_lock);
+		if (rv < 0) {
+			fmapfs_log(FUSE_LOG_ERR,
+				   "Waiting for io_uring failed: %s",
+				   strerror(-rv));
+			uring_fail(u, rv);
+			pthread_mutex_unlock(&u->sq_lock);
+			return NULL;
+		}
+
+		io_uring_for_each_cqe(&u->ring, head, cqe) {
+			struct uring_req *req = io_uring_cqe_get_data(cqe);
+
+			n++;
+
+			/* A request without a waiter is the one to stop */
+			if (!req) {
+				stop = true;
+				continue;
+			}
+
+			uring_complete(req, cqe->res);
+		}
+		io_uring_cq_advance(&u->ring, n);
+		u->in_flight -= n;
+
+		pthread_cond_broadcast(&u->reaped);
+		pthread_mutex_unlock(&u->sq_lock);
+
+		if (stop)
+			return NULL;
+	}
+}
+
+/*
+ * Submit with sq_lock held.  While the kernel is busy, which it is when
+ * completions back up, wait for the reaper to drain some rather than
+ * spinning.  With nothing in flight there is nothing to wait for, so
+ * retry a few times before giving up.  Failing leaves queued requests
+ * the kernel would still see, so it fails the ring and every request
+ * on it.  Returns the number submitted, or -errno.
+ */
+static int uring_submit_locked(struct image_uring *u)
+{
+	int retries = 0;
+	int rv;
+
+	for (;;) {
+		rv = io_uring_submit(&u->ring);
+		if (rv > 0) {
+			u->in_flight += rv;
+			return rv;
+		}
+		if (!rv && !io_uring_sq_ready(&u->ring))
+			return 0;
+
+		if (rv == -EINTR)
+			continue;
+		if (rv && rv != -EAGAIN && rv != -EBUSY)
+			break;
+
+		if (u->in_flight) {
+			pthread_cond_wait(&u->reaped, &u->sq_lock);
+		} else if (retries++ < URING_SUBMIT_RETRIES) {
+			pthread_mutex_unlock(&u->sq_lock);
+			usleep(1000);
+			pthread_mutex_lock(&u->sq_lock);
+		} else {
+			rv = rv ? rv : -EAGAIN;
+			break;
+		}
+
+		/* The reaper may have failed the ring meanwhile */
+		if (u->error)
+			return u->error;
+	}
+
+	fmapfs_log(FUSE_LOG_ERR, "io_uring submission failed: %s",
+		   strerror(-rv));
+	uring_fail(u, rv);
+
+	return rv;
+}
+
+/* Submit everything queued, by this worker or others */
+static void uring_submit(struct image_uring *u)
+{
+	pthread_mutex_lock(&u->sq_lock);
+	while (!u->error && io_uring_sq_ready(&u->ring) &&
+	       uring_submit_locked(u) > 0)
+		;
+	pthread_mutex_unlock(&u->sq_lock);
+}
+
+/*
+ * Take a free SQE, submitting the queued ones to make room if the ring
+ * is full.  On success sq_lock is held until the SQE is queued with
+ * uring_wait().  Returns 0, or -errno.
+ */
+static int uring_get_sqe(struct image_uring *u, struct io_uring_sqe **sqe)
+{
+	int rv;
+
+	pthread_mutex_lock(&u->sq_lock);
+	while (!u->error && !(*sqe = io_uring_get_sqe(&u->ring))) {
+		rv = uring_submit_locked(u);
+		if (rv < 0)
+			break;
+	}
+	if (u->error) {
+		rv = u->error;
+		pthread_mutex_unlock(&u->sq_lock);
+		return rv;
+	}
+
+	return 0;
+}
+
+/* Queue the prepared sqe, and wait for its result */
+static int uring_wait(struct image_uring *u, struct io_uring_sqe *sqe)
+{
+	struct uring_req req = { .res = -EIO };
+
+	sem_init(&req.done, 0, 0);
+
+	if (u->fixed_file)
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, &req);
+	req.next = u->pending;
+	req.pprev = &u->pending;
+	if (u->pending)
+		u->pending->pprev = &req.next;
+	u->pending = &req;
+	pthread_mutex_unlock(&u->sq_lock);
+
+	/* Give others a chance to queue theirs behind it */
+	uring_submit(u);
+
+	while (sem_wait(&req.done) && errno == EINTR)
+		;
+	sem_destroy(&req.done);
+
+	return req.res;
+}
+
+/*
+ * One read or write, from a staging buffer when buf_index isn't -1.
+ * Returns the bytes transferred, or -errno.
+ */
+static int uring_rw(struct image_uring *u, bool write, void *buf,
+		    unsigned int n_bytes, off_t offset, int buf_index)
+{
+	int fd = u->fixed_file ? 0 : u->fd;
+	struct io_uring_sqe *sqe;
+	int rv;
+
+	rv = uring_get_sqe(u, &sqe);
+	if (rv < 0)
+		return rv;
+
+	if (buf_index >= 0 && write)
+		io_uring_prep_write_fixed(sqe, fd, buf, n_bytes, offset,
+					  buf_index);
+	else if (buf_index >= 0)
+		io_uring_prep_read_fixed(sqe, fd, buf, n_bytes, offset,
+					 buf_index);
+	else if (write)
+		io_uring_prep_write(sqe, fd, buf, n_bytes, offset);
+	else
+		io_uring_prep_read(sqe, fd, buf, n_bytes, offset);
+
+	return uring_wait(u, sqe);
+}
+
+/* Devices may transfer less than asked, so loop until done */
+static ssize_t uring_transfer(struct image_uring *u, bool write, void *buf,
+			      size_t n_bytes, off_t offset, int buf_index)
+{
+	size_t done = 0;
+
+	while (done < n_bytes) {
+		size_t len = n_bytes - done;
+		int rv;
+
+		if (len > URING_MAX_TRANSFER)
+			len = URING_MAX_TRANSFER;
+
+		rv = uring_rw(u, write, (uint8_t *)buf + done, len,
+			      offset + done, buf_index);
+		if (rv == -EINTR || rv == -EAGAIN)
+			continue;
+		if (rv < 0)
+			return rv;
+		if (!rv)
+			return -EIO;
+		done += rv;
+	}
+
+	return done;
+}
+
+/*
+ * A buffer of len bytes aligned for O_DIRECT: a registered one when one
+ * is free and large enough, setting *buf_index, or an allocated one.
+ */
+static void *uring_get_buf(struct image *image, size_t len, int *buf_index)
+{
+	struct image_uring *u = image->uring;
+	void *buf;
+
+	*buf_index = -1;
+	if (len <= URING_BUF_SIZE) {
+		pthread_mutex_lock(&u->buf_lock);
+		if (u->n_free)
+			*buf_index = u->free_bufs[--u->n_free];
+		pthread_mutex_unlock(&u->buf_lock);
+	}
+
+	if (*buf_index >= 0)
+		return u->bufs + (size_t)*buf_index * URING_BUF_SIZE;
+
+	if (posix_memalign(&buf, image->align, len))
+		return NULL;
+
+	return buf;
+}
+
+static void uring_put_buf(struct image *image, void *buf, int buf_index)
+{
+	struct image_uring *u = image->uring;
+
+	if (buf_index < 0) {
+		free(buf);
+		return;
+	}
+
+	pthread_mutex_lock(&u->buf_lock);
+	u->free_bufs[u->n_free++] = buf_index;
+	pthread_mutex_unlock(&u->buf_lock);
+}
+
+/* Unregistered staging buffers are passed as plain ones */
+static int uring_buf_index(struct image_uring *u, int buf_index)
+{
+	return u->fixed_bufs ? buf_index : -1;
+}
+
+static bool uring_aligned(struct image *image, const void *buf,
+			  size_t n_bytes, off_t offset)
+{
+	return !(((uintptr_t)buf | n_bytes | offset) & (image->align - 1));
+}
+
+static ssize_t uring_read(struct image *image, void *buf, size_t n_bytes,
+			  off_t offset)
+{
+	struct image_uring *u = image->uring;
+	size_t mask = image->align - 1;
+	off_t start = offset & ~mask;
+	size_t len = (offset + n_bytes - start + mask) & ~mask;
+	int buf_index;
+	void *bounce;
+	ssize_t rv;
+
+	if (uring_aligned(image, buf, n_bytes, offset))
+		return uring_transfer(u, false, buf, n_bytes, offset, -1);
+
+	bounce = uring_get_buf(image, len, &buf_index);
+	if (!bounce)
+		return -ENOMEM;
+
+	rv = uring_transfer(u, false, bounce, len, start,
+			    uring_buf_index(u, buf_index));
+	if (rv >= 0) {
+		memcpy(buf, bounce + (offset - start), n_bytes);
+		rv = n_bytes;
+	}
+
+	uring_put_buf(image, bounce, buf_index);
+	return rv;
+}
+
+static ssize_t uring_write(struct image *image, const void *buf,
+			   size_t n_bytes, off_t offset)
+{
+	struct image_uring *u = image->uring;
+	size_t mask = image->align - 1;
+	off_t start = offset & ~mask;
+	size_t len = (offset + n_bytes - start + mask) & ~mask;
+	bool head = offset != start;
+	bool tail = (offset + n_bytes) & mask;
+	int buf_index;
+	void *bounce;
+	ssize_t rv = 0;
+
+	if (uring_aligned(image, buf, n_bytes, offset))
+		return uring_transfer(u, true, (void *)buf, n_bytes, offset,
+				      -1);
+
+	bounce = uring_get_buf(image, len, &buf_index);
+	if (!bounce)
+		return -ENOMEM;
+
+	/* Keep the bytes around the write in its first and last blocks */
+	if (head)
+		rv = uring_transfer(u, false, bounce, image->align, start,
+				    uring_buf_index(u, buf_index));
+	if (rv >= 0 && tail && !(head && len == image->align))
+		rv = uring_transfer(u, false, bounce + len - image->align,
+				    image->align, start + len - image->align,
+				    uring_buf_index(u, buf_index));
+
+	if (rv >= 0) {
+		memcpy(bounce + (offset - start), buf, n_bytes);
+		rv = uring_transfer(u, true, bounce, len, start,
+				    uring_buf_index(u, buf_index));
+	}
+
+	uring_put_buf(image, bounce, buf_index);
+	return rv < 0 ? rv : n_bytes;
+}
+
+/* Only buffered writes have anything to write back before the sync */
+static int uring_flush(struct image *image, off_t offset, size_t n_bytes,
+		       bool wait)
+{
+	struct image_uring *u = image->uring;
+	struct io_uring_sqe *sqe;
+	unsigned int flags = SYNC_FILE_RANGE_WRITE;
+	int rv;
+
+	if (image->align != 1)
+		return 0;
+
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE |
+			 SYNC_FILE_RANGE_WAIT_AFTER;
+
+	rv = uring_get_sqe(u, &sqe);
+	if (rv < 0)
+		return rv;
+
+	io_uring_prep_sync_file_range(sqe, u->fixed_file ? 0 : u->fd, n_bytes,
+				      offset, flags);
+	rv = uring_wait(u, sqe);
+
+	return rv == -EINVAL || rv == -ESPIPE ? 0 : rv;
+}
+
+static int uring_sync(struct image *image)
+{
+	struct image_uring *u = image->uring;
+	struct io_uring_sqe *sqe;
+	int rv;
+
+	rv = uring_get_sqe(u, &sqe);
+	if (rv < 0)
+		return rv;
+
+	io_uring_prep_fsync(sqe, u->fixed_file ? 0 : u->fd,
+			    IORING_FSYNC_DATASYNC);
+	rv = uring_wait(u, sqe);
+
+	return rv == -EINVAL ? 0 : rv;
+}
+
+static const struct image_ops uring_ops = {
+	.read = uring_read,
+	.write = uring_write,
+	.flush = uring_flush,
+	.sync = uring_sync,
+};
+
+static void uring_free(struct image_uring *u)
+{
+	io_uring_queue_exit(&u->ring);
+	pthread_cond_destroy(&u->reaped);
+	pthread_mutex_destroy(&u->sq_lock);
+	pthread_mutex_destroy(&u->buf_lock);
+	free(u->bufs);
+	free(u);
+}
+
+int image_uring_open(struct image *image, int fd)
+{
+	struct iovec iovecs[URING_BUFS];
+	struct image_uring *u;
+	int rv;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -1;
+
+	rv = io_uring_queue_init(URING_ENTRIES, &u->ring, 0);
+	if (rv < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to set up io_uring: %s",
+			   strerror(-rv));
+		free(u);
+		return -1;
+	}
+	pthread_mutex_init(&u->sq_lock, NULL);
+	pthread_cond_init(&u->reaped, NULL);
+	pthread_mutex_init(&u->buf_lock, NULL);
+
+	/* Aligned for any block size up to a whole buffer */
+	if (posix_memalign((void **)&u->bufs, URING_BUF_SIZE,
+			   URING_BUFS * URING_BUF_SIZE)) {
+		uring_free(u);
+		return -1;
+	}
+	for (int i = 0; i < URING_BUFS; i++) {
+		iovecs[i].iov_base = u->bufs + (size_t)i * URING_BUF_SIZE;
+		iovecs[i].iov_len = URING_BUF_SIZE;
+		u->free_bufs[u->n_free++] = URING_BUFS - 1 - i;
+	}
+
+	/* Both are optimizations, which locked memory limits may refuse */
+	u->fd = fd;
+	u->fixed_file = !io_uring_register_files(&u->ring, &fd, 1);
+	rv = io_uring_register_buffers(&u->ring, iovecs, URING_BUFS);
+	u->fixed_bufs = !rv;
+	if (rv < 0)
+		fmapfs_log(FUSE_LOG_INFO,
+			   "Unable to register io_uring buffers: %s",
+			   strerror(-rv));
+
+	if (pthread_create(&u->reaper, NULL, uring_reap, u)) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to start the io_uring reaper");
+		uring_free(u);
+		return -1;
+	}
+
+	image->uring = u;
+	image->ops = &uring_ops;
+	return 0;
+}
+
+void image_uring_close(struct image *image)
+{
+	struct image_uring *u = image->uring;
+	struct io_uring_sqe *sqe;
+	int rv;
+
+	/* Nothing is in flight any more, so a slot is free */
+	rv = uring_get_sqe(u, &sqe);
+	if (!rv) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		pthread_mutex_unlock(&u->sq_lock);
+		uring_submit(u);
+
+		pthread_mutex_lock(&u->sq_lock);
+		rv = u->error;
+		pthread_mutex_unlock(&u->sq_lock);
+	}
+
+	/* The reaper would never see the request to stop */
+	if (rv < 0)
+		pthread_cancel(u->reaper);
+	pthread_join(u->reaper, NULL);
+
+	close(u->fd);
+	uring_free(u);
+	image->uring = NULL;
+}
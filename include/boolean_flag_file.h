@@ -2,11 +2,14 @@
 #define _FMAPFS_BOOLEAN_FLAG_FILE_H_
 
 #include <stdint.h>
+#include <sys/types.h>
 
 struct arena;
 struct directory;
+struct image;
 
 void add_boolean_flag_file(struct arena *arena, struct directory *basedir,
-			   const char *name, void *val, unsigned int mask);
+			   const char *name, struct image *image,
+			   off_t image_offset, unsigned int bit);
 
 #endif /* _FMAPFS_BOOLEAN_FLAG_FILE_H_ */
@@ -0,0 +1,24 @@
+#ifndef _FMAPFS_CHANGES_H_
+#define _FMAPFS_CHANGES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct arena;
+struct directory;
+struct image;
+
+/* Whether erase_size can be reported on: a power of two, whole pages */
+bool changes_erase_size_valid(size_t erase_size);
+
+/*
+ * The changes/ directory under basedir, describing the erase blocks of
+ * erase_size bytes written since the image was opened, and the areas of
+ * the FMAP at fmap_offset they belong to.
+ */
+void add_changes_dir(struct arena *arena, struct directory *basedir,
+		     struct image *image, off_t fmap_offset,
+		     size_t erase_size);
+
+#endif /* _FMAPFS_CHANGES_H_ */
@@ -0,0 +1,52 @@
+#ifndef _FMAPFS_FLUSHER_H_
+#define _FMAPFS_FLUSHER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct image;
+
+/* When writes to the image are made durable, besides fsync() */
+enum flush_policy {
+	FLUSH_FSYNC,	/* only on fsync() */
+	FLUSH_CLOSE,	/* also on every close() of a written file */
+	FLUSH_INTERVAL, /* also every interval seconds */
+	FLUSH_WRITE,	/* before every write returns */
+};
+
+struct flusher {
+	struct image *image;
+	enum flush_policy policy;
+	double interval;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+};
+
+/*
+ * Set up flushing of image by the named policy: "fsync", "close",
+ * "interval" or "write".  NULL picks "interval".  Returns -1 if the
+ * policy is unknown.
+ */
+int flusher_init(struct flusher *flusher, struct image *image,
+		 const char *policy, double interval);
+
+/* The thread for the interval policy, once the session is running */
+int flusher_start(struct flusher *flusher);
+void flusher_stop(struct flusher *flusher);
+
+/*
+ * Hooks for a write of the image bytes [offset, offset + n_bytes), a
+ * close() of a file written through and an fsync(), returning 0 or
+ * -errno.
+ */
+int flusher_written(struct flusher *flusher, off_t offset, size_t n_bytes);
+int flusher_close(struct flusher *flusher);
+int flusher_fsync(struct flusher *flusher);
+
+#endif /* _FMAPFS_FLUSHER_H_ */
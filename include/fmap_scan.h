@@ -0,0 +1,29 @@
+#ifndef _FMAPFS_FMAP_SCAN_H_
+#define _FMAPFS_FMAP_SCAN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct fmap;
+struct image;
+
+/*
+ * Whether fmap is a sane FMAP header, given avail bytes of image from its
+ * start for the area table.  Only the header itself is read.
+ */
+bool fmap_header_valid(const struct fmap *fmap, size_t avail);
+
+/* Whether a sane FMAP header, with its area table, starts at offset */
+bool fmap_scan_valid(const uint8_t *image, size_t size, size_t offset);
+
+/*
+ * Offset of the FMAP to use, or -1 if there is none: the valid header at
+ * the most aligned offset, the first one on ties.
+ */
+ssize_t fmap_scan(const uint8_t *image, size_t size);
+
+/* As fmap_scan(), reading through the backend when it isn't mapped */
+ssize_t fmap_scan_image(struct image *image);
+
+#endif /* _FMAPFS_FMAP_SCAN_H_ */
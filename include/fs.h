@@ -1,22 +1,91 @@
 #ifndef _FMAPFS_FS_H_
 #define _FMAPFS_FS_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 
 #include "arena.h"
+#include "flusher.h"
+#include "image.h"
+#include "route.h"
+#include "view.h"
 
 struct fmap;
 struct directory_entry;
+
+/* Options parsed from the command line using fuse_opt */
+struct fmapfs_options {
+	int lowlevel;
+	double cache_timeout;
+	int keep_cache;
+	unsigned int max_write;
+	unsigned int max_background;
+	unsigned int trace;
+	int lazy;
+	unsigned int max_images;
+	unsigned int max_mapped;
+	char *backend;
+	char *flush;
+	double flush_interval;
+	unsigned int erase_size;
+};
+
+/* The defaults, for every program loading images */
+#define FMAPFS_OPTIONS_INIT()            \
+	{                                \
+		.cache_timeout = 3600.0, \
+		.keep_cache = 1,         \
+		.max_background = 64,    \
+		.max_images = 64,        \
+		.flush_interval = 5.0,   \
+		.erase_size = 4096,      \
+	}
+
+
 struct fmapfs_state {
-	void *image;
-	ssize_t image_size;
+	struct image image;
+
+	/* A copy of the FMAP, and where the original is in the image */
 	struct fmap *fmap;
+	off_t fmap_offset;
+
 	struct directory_entry *rootdir;
+	struct inode_table inodes;
+	struct path_index paths;
+	struct view_map views;
+	struct flusher flusher;
+	struct fmapfs_options opts;
+
+	/* Serializes populating lazy directories, which use the arena */
+	pthread_mutex_t lazy_lock;
 	struct arena arena;
 };
 
 int fmapfs_load_image(struct fmapfs_state *state, const char *image_path);
+void fmapfs_unload_image(struct fmapfs_state *state);
+
+struct fuse_file_info;
+
+/*
+ * After n_bytes were written at offset through the open file fi, and on
+ * every close() of it: both return 0 or -errno.
+ */
+int fmapfs_written(struct fmapfs_state *state, struct fuse_file_info *fi,
+		   off_t offset, size_t n_bytes);
+int fmapfs_closed(struct fmapfs_state *state, struct fuse_file_info *fi);
+
+struct stat;
+int fmapfs_image_getattr(struct fmapfs_state *state, const char *path,
+			 struct stat *st);
+int fmapfs_image_opendir(struct fmapfs_state *state, const char *path,
+			 struct fuse_file_info *fi);
+int fmapfs_image_open(struct fmapfs_state *state, const char *path,
+		      struct fuse_file_info *fi);
+struct fmapfs_state *fmapfs_handle_state(struct fuse_file_info *fi);
+
+struct fuse_conn_info;
+void fmapfs_tune_conn(struct fmapfs_options *opts, struct fuse_conn_info *conn);
 
 struct fuse_operations;
 extern const struct fuse_operations fmapfs_ops;
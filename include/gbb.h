@@ -5,8 +5,9 @@
 
 struct arena;
 struct directory;
+struct image;
 
 int setup_gbb_files(struct arena *arena, struct directory *basedir,
-		    void *gbb_mem, size_t gbb_size);
+		    struct image *image, off_t gbb_offset, size_t gbb_size);
 
 #endif /* _FMAPFS_GBB_H_ */
@@ -0,0 +1,111 @@
+#ifndef _FMAPFS_IMAGE_H_
+#define _FMAPFS_IMAGE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct image;
+struct image_uring;
+
+/*
+ * Access to the bytes of an image.  Callers keep within the image, and
+ * serialize writes against any other access to the same bytes with view
+ * locks.  Both return n_bytes, or -errno.
+ */
+struct image_ops {
+	ssize_t (*read)(struct image *image, void *buf, size_t n_bytes,
+			off_t offset);
+	ssize_t (*write)(struct image *image, const void *buf, size_t n_bytes,
+			 off_t offset);
+
+	/*
+	 * Optional: start writing [offset, offset + n_bytes) back, and
+	 * with wait, return once it has been.  Returns 0 or -errno.
+	 */
+	int (*flush)(struct image *image, off_t offset, size_t n_bytes,
+		     bool wait);
+
+	/* Optional: make everything written back so far durable */
+	int (*sync)(struct image *image);
+};
+
+/* Written bytes are tracked, and flushed, in pages of this size */
+#define IMAGE_DIRTY_SHIFT 12
+
+struct image {
+	const struct image_ops *ops;
+	const char *backend;
+	size_t size;
+
+	/* The whole image when it is mapped, NULL otherwise */
+	void *mem;
+
+	/* A descriptor going through the page cache, which may be spliced */
+	int fd;
+
+	/* For O_DIRECT: the descriptor, and the alignment it needs */
+	int direct_fd;
+	size_t align;
+
+	/* The io_uring engine, which owns its own descriptor */
+	struct image_uring *uring;
+
+	/*
+	 * Pages written since they were last flushed, one bit each, and
+	 * whether any bit may be set.  Flushes are serialized.
+	 */
+	uint64_t *dirty;
+	bool any_dirty;
+	pthread_mutex_t flush_lock;
+
+	/* Pages written since the image was opened, never cleared */
+	uint64_t *changed;
+};
+
+/*
+ * Open the image at path with the named backend: "mmap", "pread",
+ * "direct" (pread and pwrite with O_DIRECT) or, when built with liburing,
+ * "uring".  NULL picks mmap for regular files and pread for devices.
+ */
+int image_open(struct image *image, const char *path, const char *backend);
+void image_close(struct image *image);
+
+static inline ssize_t image_read(struct image *image, void *buf,
+				 size_t n_bytes, off_t offset)
+{
+	return image->ops->read(image, buf, n_bytes, offset);
+}
+
+/* Whether any page overlapping [offset, offset + n_bytes) was written */
+bool image_changed(struct image *image, off_t offset, size_t n_bytes);
+
+/* Note bytes written other than with image_write(), to be flushed */
+void image_mark_dirty(struct image *image, off_t offset, size_t n_bytes);
+
+/*
+ * Write back every page written since the last flush, in runs of
+ * adjacent pages.  With wait, returns once they are durable, and only
+ * then forgets them; without, just starts writeback.  Returns 0 or
+ * -errno, in which case the pages stay dirty.
+ */
+int image_flush(struct image *image, bool wait);
+
+/* As image_flush(), for just the pages overlapping [offset, +n_bytes) */
+int image_flush_range(struct image *image, off_t offset, size_t n_bytes,
+		      bool wait);
+
+static inline ssize_t image_write(struct image *image, const void *buf,
+				  size_t n_bytes, off_t offset)
+{
+	ssize_t rv = image->ops->write(image, buf, n_bytes, offset);
+
+	if (rv > 0)
+		image_mark_dirty(image, offset, rv);
+
+	return rv;
+}
+
+#endif /* _FMAPFS_IMAGE_H_ */
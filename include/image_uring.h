@@ -0,0 +1,13 @@
+#ifndef _FMAPFS_IMAGE_URING_H_
+#define _FMAPFS_IMAGE_URING_H_
+
+struct image;
+
+/*
+ * Set up the io_uring engine for image, doing its I/O on fd in blocks of
+ * image->align bytes.  The engine owns fd once this succeeds.
+ */
+int image_uring_open(struct image *image, int fd);
+void image_uring_close(struct image *image);
+
+#endif /* _FMAPFS_IMAGE_URING_H_ */
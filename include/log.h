@@ -0,0 +1,21 @@
+#ifndef _FMAPFS_LOG_H_
+#define _FMAPFS_LOG_H_
+
+#include <fuse_log.h>
+
+/*
+ * Most verbose level compiled in, set with the log_level meson option.
+ * Messages above it are dropped at compile time, along with the cost of
+ * evaluating and formatting their arguments.
+ */
+#ifndef FMAPFS_LOG_LEVEL
+#define FMAPFS_LOG_LEVEL FUSE_LOG_DEBUG
+#endif
+
+#define fmapfs_log(level, ...)                        \
+	do {                                          \
+		if ((level) <= FMAPFS_LOG_LEVEL)      \
+			fuse_log(level, __VA_ARGS__); \
+	} while (0)
+
+#endif /* _FMAPFS_LOG_H_ */
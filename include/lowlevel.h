@@ -0,0 +1,12 @@
+#ifndef _FMAPFS_LOWLEVEL_H_
+#define _FMAPFS_LOWLEVEL_H_
+
+struct fuse_args;
+struct fmapfs_state;
+
+int fmapfs_lowlevel_main(struct fuse_args *args, struct fmapfs_state *state);
+
+struct fuse_lowlevel_ops;
+extern const struct fuse_lowlevel_ops fmapfs_ll_ops;
+
+#endif /* _FMAPFS_LOWLEVEL_H_ */
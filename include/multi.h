@@ -0,0 +1,10 @@
+#ifndef _FMAPFS_MULTI_H_
+#define _FMAPFS_MULTI_H_
+
+struct fuse_args;
+struct fmapfs_options;
+
+int fmapfs_multi_main(struct fuse_args *args, const char *dir_path,
+		      struct fmapfs_options *opts);
+
+#endif /* _FMAPFS_MULTI_H_ */
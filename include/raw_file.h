@@ -1,7 +1,14 @@
 #ifndef _FMAPFS_RAW_FILE_H_
 #define _FMAPFS_RAW_FILE_H_
 
+#include <sys/types.h>
+
+struct arena;
+struct directory;
+struct image;
+
 void add_raw_file(struct arena *arena, struct directory *basedir,
-		  const char *name, void *mem, size_t size);
+		  const char *name, struct image *image, off_t image_offset,
+		  size_t size);
 
 #endif /* _FMAPFS_RAW_FILE_H_ */
@@ -0,0 +1,22 @@
+#ifndef _FMAPFS_RENDERED_FILE_H_
+#define _FMAPFS_RENDERED_FILE_H_
+
+#include <stddef.h>
+
+#include "route.h"
+
+/* A file whose content is generated from image bytes */
+struct render_ops {
+	/* Generate the whole content into buf, returning its length */
+	size_t (*render)(char *buf, size_t size, void *param);
+
+	int (*write)(const char *buf, size_t n_bytes, off_t offset,
+		     struct fuse_file_info *fi, void *param);
+	void (*get_extent)(void *param, struct file_extent *extent);
+};
+
+void add_rendered_file(struct arena *arena, struct directory *basedir,
+		       const char *name, const struct render_ops *ops,
+		       void *param, size_t max_size);
+
+#endif /* _FMAPFS_RENDERED_FILE_H_ */
@@ -2,28 +2,92 @@
 #define _FMAPFS_ROUTE_H_
 
 #include <fuse.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "arena.h"
 
 struct directory;
+struct view;
+
+/* The image bytes rendered by a file */
+struct file_extent {
+	off_t offset;
+	size_t size;
+	/* File offset N is stored at image offset offset + N */
+	bool linear;
+};
 
 struct file_ops {
+	/* The kernel may keep cached pages of this file across opens */
+	bool keep_cache;
+	/* Content changes on every read, bypass the page cache */
+	bool direct_io;
+
 	size_t (*get_size)(void *param);
 	int (*read)(char *buf, size_t n_bytes, off_t offset,
 		    struct fuse_file_info *fi, void *param);
 	int (*write)(const char *buf, size_t n_bytes, off_t offset,
 		     struct fuse_file_info *fi, void *param);
+
+	/*
+	 * Optional: describe where the data lives instead of copying it.
+	 * Fills buf->mem if the data is in memory, and buf->fd and buf->pos
+	 * if it can be read from a file descriptor.  Callers fall back to
+	 * read() when it's neither.
+	 */
+	int (*read_buf)(struct fuse_buf *buf, size_t n_bytes, off_t offset,
+			struct fuse_file_info *fi, void *param);
+
+	/* Optional: write from a buffer vector without flattening it */
+	int (*write_buf)(struct fuse_bufvec *src, off_t offset,
+			 struct fuse_file_info *fi, void *param);
+
+	/* Optional: the image bytes this file renders */
+	void (*get_extent)(void *param, struct file_extent *extent);
+
+	/*
+	 * Optional: state for one open of the file, freed by release().
+	 * Callbacks find it with route_file_priv().  Returns 0 or -errno.
+	 */
+	int (*open)(void **priv, void *param);
+	void (*release)(void *priv, void *param);
 };
 
+/* What fi->fh points to for an open regular file, in both engines */
+struct open_file {
+	struct directory_entry *entry;
+	void *priv;
+
+	/* Written through since the last close() was flushed */
+	bool written;
+};
+
+static inline void *route_file_priv(struct fuse_file_info *fi)
+{
+	return ((struct open_file *)(uintptr_t)fi->fh)->priv;
+}
+
 struct directory_entry {
 	mode_t mode;
 	char *name;
+	size_t name_len;
+	ino_t ino;
+	struct directory_entry *parent;
+
+	/*
+	 * Attributes filled in with the inode table.  st_size is -1 until
+	 * it has been computed, and again after writes that may change it.
+	 */
+	struct stat st;
+
 	union {
 		struct {
 			struct file_ops *ops;
 			void *param;
+			struct view *view;
 		} reg_file;
 		struct directory *dir;
 	};
@@ -34,8 +98,66 @@ struct dir_list {
 	struct dir_list *next;
 };
 
+struct dir_slot {
+	uint32_t hash;
+	uint32_t name_len;
+	struct directory_entry *entry;
+};
+
 struct directory {
 	struct dir_list *entries;
+
+	/*
+	 * Filled in by route_freeze(): the children in list order, and an
+	 * open-addressed hash index of them (a power of two in size).
+	 */
+	struct directory_entry **children;
+	size_t n_children;
+	struct dir_slot *slots;
+	size_t n_slots;
+
+	/*
+	 * Set for directories built on first use: populate() fills in the
+	 * entries and freezes them, then sets populated.
+	 */
+	void (*populate)(struct directory_entry *entry, void *param);
+	void *populate_param;
+	bool populated;
+};
+
+/*
+ * Entries by inode number, the root being inode 1.  The table may grow
+ * as lazy directories are populated: entries and n_inodes are published
+ * with release stores, and replaced tables stay allocated in the arena.
+ */
+struct inode_table {
+	struct directory_entry **entries;
+	size_t n_inodes;
+	size_t capacity;
+};
+
+struct path_slot {
+	uint32_t hash;
+	uint32_t path_len;
+	const char *path;
+	struct directory_entry *entry;
+};
+
+/* One generation of the path index, a power of two in size */
+struct path_table {
+	size_t n_slots;
+	struct path_slot slots[];
+};
+
+/*
+ * Whole path to entry index for the path-based API.  It grows as lazy
+ * directories are populated: slots are filled in with a release store of
+ * their entry, and a full table is replaced by publishing a larger one,
+ * the old one staying allocated in the arena.
+ */
+struct path_index {
+	struct path_table *table;
+	size_t n_used;
 };
 
 struct directory_entry *route_new_root(struct arena *arena);
@@ -45,10 +167,37 @@ void route_add_entry_to_directory(struct arena *arena,
 struct directory *route_new_subdirectory(struct arena *arena,
 					 struct directory *basedir,
 					 const char *name);
-void route_new_file(struct arena *arena, struct directory *basedir,
-		    const char *name, struct file_ops *ops, void *param);
+struct directory_entry *route_new_file(struct arena *arena,
+				       struct directory *basedir,
+				       const char *name, struct file_ops *ops,
+				       void *param);
 
+struct directory *route_get_dir(struct directory_entry *entry);
+struct directory_entry *route_lookup_child(struct directory_entry *dir,
+					   const char *name, size_t name_len);
 struct directory_entry *route_lookup_path(struct directory_entry *root,
 					  const char *path);
 
+void route_freeze(struct arena *arena, struct directory_entry *root);
+void route_build_inode_table(struct arena *arena, struct inode_table *table,
+			     struct directory_entry *root);
+size_t route_extend_inode_table(struct arena *arena, struct inode_table *table,
+				struct directory_entry *dir);
+struct directory_entry *route_get_inode(struct inode_table *table,
+					uint64_t ino);
+void route_build_path_index(struct arena *arena, struct path_index *index,
+			    struct inode_table *inodes);
+void route_extend_path_index(struct arena *arena, struct path_index *index,
+			     struct inode_table *inodes, size_t first);
+struct directory_entry *route_lookup_indexed(struct path_index *index,
+					     struct directory_entry *root,
+					     const char *path);
+void route_fill_stat(struct directory_entry *entry, struct stat *st);
+void route_invalidate_stat(struct directory_entry *entry);
+int route_get_path(struct directory_entry *entry, char *buf, size_t size);
+int route_write_buf(struct directory_entry *entry, struct fuse_bufvec *src,
+		    off_t offset, struct fuse_file_info *fi);
+int route_open_file(struct open_file *handle);
+void route_release_file(struct open_file *handle);
+
 #endif /* _FMAPFS_ROUTE_H_ */
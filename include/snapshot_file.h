@@ -0,0 +1,17 @@
+#ifndef _FMAPFS_SNAPSHOT_FILE_H_
+#define _FMAPFS_SNAPSHOT_FILE_H_
+
+#include <stdio.h>
+
+#include "route.h"
+
+/*
+ * A file whose whole content is printed when it is opened, so each open
+ * reads one consistent snapshot, whatever other readers do.  print()
+ * returns 0 or -errno.
+ */
+void add_snapshot_file(struct arena *arena, struct directory *basedir,
+		       const char *name,
+		       int (*print)(FILE *out, void *param), void *param);
+
+#endif /* _FMAPFS_SNAPSHOT_FILE_H_ */
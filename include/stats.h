@@ -0,0 +1,67 @@
+#ifndef _FMAPFS_STATS_H_
+#define _FMAPFS_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct arena;
+struct directory;
+
+enum stats_op {
+	/* High-level handlers */
+	STATS_GETATTR,
+	STATS_OPENDIR,
+	STATS_READDIR,
+	STATS_RELEASEDIR,
+	STATS_OPEN,
+	STATS_RELEASE,
+	STATS_READ,
+	STATS_READ_BUF,
+	STATS_WRITE,
+	STATS_WRITE_BUF,
+	STATS_FLUSH,
+	STATS_FSYNC,
+
+	/* file_ops callbacks, for both engines */
+	STATS_FILE_GET_SIZE,
+	STATS_FILE_READ,
+	STATS_FILE_READ_BUF,
+	STATS_FILE_WRITE,
+	STATS_FILE_WRITE_BUF,
+
+	/* Runs of dirty pages written back from the image */
+	STATS_FLUSH_RUN,
+
+	/* Path lookups of the high-level engine, by whether indexed */
+	STATS_PATH_INDEX_HIT,
+	STATS_PATH_INDEX_MISS,
+
+	STATS_N_OPS,
+};
+
+static inline uint64_t stats_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Record one operation: rv < 0 is an error, otherwise bytes moved */
+void stats_end(enum stats_op op, uint64_t start, int64_t rv);
+
+/* Count one operation without timing it, for ones too cheap to time */
+void stats_count(enum stats_op op);
+
+/* Time an expression returning a byte count or -errno */
+#define STATS_CALL(op, call)                              \
+	({                                                \
+		uint64_t _stats_start = stats_start();    \
+		__typeof__(call) _stats_rv = (call);      \
+		stats_end((op), _stats_start, _stats_rv); \
+		_stats_rv;                                \
+	})
+
+void add_stats_files(struct arena *arena, struct directory *basedir);
+
+#endif /* _FMAPFS_STATS_H_ */
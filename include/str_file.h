@@ -2,9 +2,14 @@
 #define _FMAPFS_STR_FILE_H_
 
 #include <stdbool.h>
+#include <sys/types.h>
+
+struct arena;
+struct directory;
+struct image;
 
 void add_str_file(struct arena *arena, struct directory *basedir,
-		  const char *name, char *str, size_t max_size,
-		  bool add_newline);
+		  const char *name, struct image *image, off_t image_offset,
+		  size_t max_size, bool add_newline);
 
 #endif /* _FMAPFS_STR_FILE_H_ */
@@ -0,0 +1,46 @@
+#ifndef _FMAPFS_TRACE_H_
+#define _FMAPFS_TRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+struct arena;
+struct directory;
+
+/* Events kept per thread, 0 when tracing is off */
+extern unsigned int trace_entries;
+
+/* Allocate rings of at least the given number of events on first use */
+void trace_enable(unsigned int entries);
+
+void trace_push(enum stats_op op, uint64_t ino, off_t offset, size_t size,
+		uint64_t start, int64_t rv);
+
+/* Record one file operation started at start (from stats_start()) */
+static inline void trace_record(enum stats_op op, uint64_t ino, off_t offset,
+				size_t size, uint64_t start, int64_t rv)
+{
+	if (__builtin_expect(trace_entries != 0, 0))
+		trace_push(op, ino, offset, size, start, rv);
+}
+
+/* Time, count and trace a file_ops call on entry */
+#define TRACE_CALL(op, entry, offset, size, call)                  \
+	({                                                         \
+		uint64_t _trace_start = stats_start();             \
+		__typeof__(call) _trace_rv = (call);               \
+		stats_end((op), _trace_start, _trace_rv);          \
+		trace_record((op), (entry)->ino, (offset), (size), \
+			     _trace_start, _trace_rv);             \
+		_trace_rv;                                         \
+	})
+
+/* Dump the rings to stderr on SIGUSR1, while the session runs */
+int trace_start(void);
+void trace_stop(void);
+
+void add_trace_file(struct arena *arena, struct directory *basedir);
+
+#endif /* _FMAPFS_TRACE_H_ */
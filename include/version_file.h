@@ -1,7 +1,14 @@
 #ifndef _FMAPFS_VERSION_FILE_H_
 #define _FMAPFS_VERSION_FILE_H_
 
+#include <sys/types.h>
+
+struct arena;
+struct directory;
+struct image;
+
+/* The major and minor version bytes, adjacent at image_offset */
 void add_version_file(struct arena *arena, struct directory *basedir,
-		      const char *name, struct fmap *fmap);
+		      const char *name, struct image *image, off_t image_offset);
 
 #endif /* _FMAPFS_VERSION_FILE_H_ */
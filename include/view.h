@@ -0,0 +1,88 @@
+#ifndef _FMAPFS_VIEW_H_
+#define _FMAPFS_VIEW_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct arena;
+struct directory_entry;
+struct fuse;
+struct fuse_session;
+struct view_map;
+
+/*
+ * Image bytes are protected by striped reader/writer locks: each 64 KiB
+ * chunk of the image hashes to one of 64 stripes.
+ */
+#define VIEW_LOCK_STRIPES 64
+#define VIEW_LOCK_CHUNK_SHIFT 16
+
+/* A file rendering the image bytes [start, end) */
+struct view {
+	size_t start;
+	size_t end;
+	bool linear;
+	struct directory_entry *entry;
+
+	/* Stripes covering [start, end), for views which aren't linear */
+	struct view_map *map;
+	uint64_t lock_mask;
+
+	/* Bumped after every write to [start, end) */
+	uint64_t generation;
+
+	/* File range waiting to be invalidated by the notifier thread */
+	bool pending;
+	off_t pending_start;
+	off_t pending_end;
+	struct view *next_pending;
+};
+
+struct view_map {
+	size_t image_size;
+
+	/* Sorted by start, changed only under lock */
+	struct view **views;
+	size_t n_views;
+	size_t capacity;
+	size_t max_view_size;
+
+	pthread_rwlock_t stripes[VIEW_LOCK_STRIPES];
+
+	/* Exactly one of these is set once the session is running */
+	struct fuse *fuse;
+	struct fuse_session *se;
+
+	/* Prepended to the paths invalidated through fuse, if set */
+	const char *path_prefix;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t notifier;
+	bool running;
+	bool stopping;
+	struct view *pending;
+};
+
+void view_map_init(struct view_map *map, size_t image_size);
+void view_map_add(struct view_map *map, struct arena *arena,
+		  struct directory_entry **entries, size_t n_entries);
+void view_map_written(struct view_map *map, struct directory_entry *entry,
+		      off_t offset, size_t n_bytes);
+
+/*
+ * The image bytes [*start, *end) behind n_bytes of the file at offset:
+ * just those for a linear view, all it renders otherwise.  False when
+ * there are none, or no view.
+ */
+bool view_image_range(struct view *view, off_t offset, size_t n_bytes,
+		      size_t *start, size_t *end);
+uint64_t view_lock(struct view *view, off_t offset, size_t n_bytes,
+		   bool write);
+void view_unlock(struct view *view, uint64_t mask);
+int view_map_start(struct view_map *map);
+void view_map_stop(struct view_map *map);
+
+#endif /* _FMAPFS_VIEW_H_ */
@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fuse_lowlevel.h>
+
+#include "fs.h"
+#include "log.h"
+#include "lowlevel.h"
+#include "route.h"
+#include "stats.h"
+#include "trace.h"
+#include "view.h"
+
+static struct directory_entry *ll_get_entry(fuse_req_t req, fuse_ino_t ino)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+
+	return route_get_inode(&state->inodes, ino);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct fmapfs_state *state = userdata;
+
+	fmapfs_tune_conn(&state->opts, conn);
+	view_map_start(&state->views);
+	flusher_start(&state->flusher);
+	trace_start();
+}
+
+static void ll_destroy(void *userdata)
+{
+	struct fmapfs_state *state = userdata;
+
+	view_map_stop(&state->views);
+	flusher_stop(&state->flusher);
+	trace_stop();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *dir = ll_get_entry(req, parent);
+	struct directory_entry *entry;
+	struct fuse_entry_param e = { 0 };
+
+	if (!dir) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISDIR(dir->mode)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	e.attr_timeout = state->opts.cache_timeout;
+	e.entry_timeout = state->opts.cache_timeout;
+
+	/* Names never appear later, so misses are cached too (ino 0) */
+	entry = route_lookup_child(dir, name, strlen(name));
+	if (!entry) {
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	e.ino = entry->ino;
+	route_fill_stat(entry, &e.attr);
+
+	fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	/* Inodes live as long as the mount, nothing to release */
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data *forgets)
+{
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	struct stat st;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	route_fill_stat(entry, &st);
+	fuse_reply_attr(req, &st, state->opts.cache_timeout);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	struct open_file *handle;
+	mode_t accmode;
+	int rv;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISREG(entry->mode)) {
+		fmapfs_log(FUSE_LOG_ERR, "%s is not a regular file",
+			   entry->name);
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	accmode = fi->flags & O_ACCMODE;
+
+	if (accmode != O_WRONLY && !entry->reg_file.ops->read) {
+		fmapfs_log(FUSE_LOG_ERR, "No read operation on %s",
+			   entry->name);
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	if (accmode != O_RDONLY && !entry->reg_file.ops->write) {
+		fmapfs_log(FUSE_LOG_ERR, "No write operation on %s",
+			   entry->name);
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	fi->keep_cache = state->opts.keep_cache &&
+			 entry->reg_file.ops->keep_cache;
+	fi->direct_io = entry->reg_file.ops->direct_io;
+
+	/* Only for the file's own state, entries come from the inode */
+	handle = calloc(1, sizeof(*handle));
+	if (!handle) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	handle->entry = entry;
+
+	rv = route_open_file(handle);
+	if (rv < 0) {
+		free(handle);
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	fi->fh = (uintptr_t)handle;
+	if (fuse_reply_open(req, fi) < 0) {
+		route_release_file(handle);
+		free(handle);
+	}
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	struct open_file *handle = (struct open_file *)(uintptr_t)fi->fh;
+
+	route_release_file(handle);
+	free(handle);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		    struct fuse_file_info *fi)
+{
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	uint64_t locked;
+	char *buf;
+	int rv;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISREG(entry->mode)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	if (!entry->reg_file.ops->read) {
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support reading",
+			   entry->name);
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	/* Reply straight from the image mapping or descriptor when possible */
+	if (entry->reg_file.ops->read_buf) {
+		struct fuse_buf data = { .fd = -1 };
+		struct fuse_bufvec bufv;
+
+		/* The reply copies from the image, so hold the lock */
+		locked = view_lock(entry->reg_file.view, off, size, false);
+		rv = TRACE_CALL(STATS_FILE_READ_BUF, entry, off, size,
+				entry->reg_file.ops->read_buf(
+					&data, size, off, fi,
+					entry->reg_file.param));
+		if (rv >= 0 && !data.mem && data.fd < 0) {
+			/* Neither, so copy with read() below */
+			view_unlock(entry->reg_file.view, locked);
+			goto copy;
+		}
+
+		if (rv < 0) {
+			fuse_reply_err(req, -rv);
+		} else {
+			bufv = FUSE_BUFVEC_INIT(rv);
+			if (data.mem) {
+				bufv.buf[0].mem = data.mem;
+			} else {
+				bufv.buf[0].flags =
+					FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				bufv.buf[0].fd = data.fd;
+				bufv.buf[0].pos = data.pos;
+			}
+			fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+		}
+		view_unlock(entry->reg_file.view, locked);
+		return;
+	}
+
+copy:
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	locked = view_lock(entry->reg_file.view, off, size, false);
+	rv = TRACE_CALL(STATS_FILE_READ, entry, off, size,
+			entry->reg_file.ops->read(buf, size, off, fi,
+						  entry->reg_file.param));
+	view_unlock(entry->reg_file.view, locked);
+	if (rv < 0)
+		fuse_reply_err(req, -rv);
+	else
+		fuse_reply_buf(req, buf, rv);
+
+	free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		     size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	uint64_t locked;
+	int err;
+	int rv;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISREG(entry->mode)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	if (!entry->reg_file.ops->write) {
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support writing",
+			   entry->name);
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	locked = view_lock(entry->reg_file.view, off, size, true);
+	rv = TRACE_CALL(STATS_FILE_WRITE, entry, off, size,
+			entry->reg_file.ops->write(buf, size, off, fi,
+						   entry->reg_file.param));
+	view_unlock(entry->reg_file.view, locked);
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	/* Drop cached sizes before the kernel can ask for them again */
+	err = fmapfs_written(state, fi, off, rv);
+	if (err < 0)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_write(req, rv);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_bufvec *bufv, off_t off,
+			 struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	uint64_t locked;
+	int err;
+	int rv;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISREG(entry->mode)) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	if (!entry->reg_file.ops->write) {
+		fmapfs_log(FUSE_LOG_ERR, "%s does not support writing",
+			   entry->name);
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	locked = view_lock(entry->reg_file.view, off, fuse_buf_size(bufv),
+			   true);
+	rv = route_write_buf(entry, bufv, off, fi);
+	view_unlock(entry->reg_file.view, locked);
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	/* Drop cached sizes before the kernel can ask for them again */
+	err = fmapfs_written(state, fi, off, rv);
+	if (err < 0)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_write(req, rv);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+		     struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+
+	fuse_reply_err(req, -fmapfs_closed(state, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		     struct fuse_file_info *fi)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+
+	fuse_reply_err(req, -flusher_fsync(&state->flusher));
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	struct directory_entry *entry = ll_get_entry(req, ino);
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISDIR(entry->mode)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Directory offsets are entry indices: 0 is ".", 1 is "..", and the
+ * children follow in route order.  Each entry records the offset of the
+ * entry after it, as the kernel expects.  Attributes come from the
+ * precomputed stat of each entry, so readdirplus costs no more than a
+ * plain readdir.
+ */
+static void ll_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t off, bool plus)
+{
+	struct fmapfs_state *state = fuse_req_userdata(req);
+	struct directory_entry *entry = ll_get_entry(req, ino);
+	struct directory *dir;
+	char *buf;
+	size_t pos = 0;
+	off_t idx;
+
+	if (!entry) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!S_ISDIR(entry->mode)) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	dir = route_get_dir(entry);
+	for (idx = off; idx < 2 + (off_t)dir->n_children; idx++) {
+		struct fuse_entry_param e = { 0 };
+		const char *name;
+		size_t entsize;
+
+		/* "." and ".." are listed without creating entries (ino 0) */
+		if (idx == 0) {
+			name = ".";
+			e.attr.st_ino = entry->ino;
+			e.attr.st_mode = entry->mode;
+		} else if (idx == 1) {
+			name = "..";
+			e.attr.st_ino = entry->parent->ino;
+			e.attr.st_mode = entry->parent->mode;
+		} else {
+			struct directory_entry *child = dir->children[idx - 2];
+
+			name = child->name;
+			if (plus) {
+				e.ino = child->ino;
+				e.attr_timeout = state->opts.cache_timeout;
+				e.entry_timeout = state->opts.cache_timeout;
+				route_fill_stat(child, &e.attr);
+			} else {
+				e.attr.st_ino = child->ino;
+				e.attr.st_mode = child->mode;
+			}
+		}
+
+		if (plus)
+			entsize = fuse_add_direntry_plus(req, buf + pos,
+							 size - pos, name, &e,
+							 idx + 1);
+		else
+			entsize = fuse_add_direntry(req, buf + pos, size - pos,
+						    name, &e.attr, idx + 1);
+		if (entsize > size - pos)
+			break;
+		pos += entsize;
+	}
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		       struct fuse_file_info *fi)
+{
+	ll_do_readdir(req, ino, size, off, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *fi)
+{
+	ll_do_readdir(req, ino, size, off, true);
+}
+
+const struct fuse_lowlevel_ops fmapfs_ll_ops = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.open = ll_open,
+	.release = ll_release,
+	.read = ll_read,
+	.write = ll_write,
+	.write_buf = ll_write_buf,
+	.flush = ll_flush,
+	.fsync = ll_fsync,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.readdirplus = ll_readdirplus,
+};
+
+int fmapfs_lowlevel_main(struct fuse_args *args, struct fmapfs_state *state)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	int rv = 1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+
+	se = fuse_session_new(args, &fmapfs_ll_ops, sizeof(fmapfs_ll_ops),
+			      state);
+	if (!se)
+		goto exit;
+	state->views.se = se;
+
+	if (fuse_set_signal_handlers(se) != 0)
+		goto exit_destroy;
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto exit_remove_handlers;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		rv = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		rv = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+
+exit_remove_handlers:
+	fuse_remove_signal_handlers(se);
+exit_destroy:
+	fuse_session_destroy(se);
+exit:
+	free(opts.mountpoint);
+	return rv ? 1 : 0;
+}
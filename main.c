@@ -1,13 +1,37 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <fuse.h>
 
 #include "arena.h"
 #include "array_size.h"
 #include "fs.h"
+#include "lowlevel.h"
+#include "multi.h"
+
+#define FMAPFS_OPT(t, p, v) { t, offsetof(struct fmapfs_options, p), v }
+
+static const struct fuse_opt fmapfs_opts[] = {
+	FMAPFS_OPT("lowlevel", lowlevel, 1),
+	FMAPFS_OPT("cache_timeout=%lf", cache_timeout, 0),
+	FMAPFS_OPT("keep_cache", keep_cache, 1),
+	FMAPFS_OPT("nokeep_cache", keep_cache, 0),
+	FMAPFS_OPT("max_write=%u", max_write, 0),
+	FMAPFS_OPT("max_background=%u", max_background, 0),
+	FMAPFS_OPT("trace=%u", trace, 0),
+	FMAPFS_OPT("lazy", lazy, 1),
+	FMAPFS_OPT("max_images=%u", max_images, 0),
+	FMAPFS_OPT("max_mapped=%u", max_mapped, 0),
+	FMAPFS_OPT("backend=%s", backend, 0),
+	FMAPFS_OPT("flush=%s", flush, 0),
+	FMAPFS_OPT("flush_interval=%lf", flush_interval, 0),
+	FMAPFS_OPT("erase_size=%u", erase_size, 0),
+	FUSE_OPT_END,
+};
 
 static void show_help(char *progname)
 {
@@ -18,8 +42,50 @@ static void show_help(char *progname)
 	};
 
 	fprintf(stderr,
-		"Usage: %s [fuse options...] [firmware file] [mount path]\n\n",
-		progname);
+		"Usage: %s [fuse options...] [firmware file] [mount path]\n"
+		"       %s [fuse options...] [firmware dir] [mount path]\n\n",
+		progname, progname);
+	fprintf(stderr,
+		"fmapfs options:\n"
+		"    -o lowlevel            use the low-level (inode) API\n"
+		"    -o cache_timeout=T     cache names and attributes for T\n"
+		"                           seconds (default: 3600)\n"
+		"    -o [no]keep_cache      keep cached region data across\n"
+		"                           opens (default: on)\n"
+		"    -o max_write=N         largest write request in bytes\n"
+		"                           (default: as large as possible)\n"
+		"    -o max_background=N    background requests in flight\n"
+		"                           (default: 64)\n"
+		"    -o max_idle_threads=N  idle worker threads to keep;\n"
+		"                           more start under load\n"
+		"    -s                     use a single worker thread\n"
+		"    -o trace=N             keep the last N file operations\n"
+		"                           of each thread in .fmapfs/trace,\n"
+		"                           dumped to stderr on SIGUSR1\n"
+		"    -o lazy                build each area's files on first\n"
+		"                           access instead of at mount\n"
+		"    -o backend=B           access the image with mmap, pread\n"
+#ifdef FMAPFS_IO_URING
+		"                           direct or uring (default: mmap\n"
+		"                           for files, pread for devices)\n"
+#else
+		"                           or direct (default: mmap for\n"
+		"                           files, pread for devices)\n"
+#endif
+		"    -o flush=P             flush on each write, close,\n"
+		"                           interval or only on fsync\n"
+		"                           (default: interval)\n"
+		"    -o flush_interval=S    seconds between interval flushes\n"
+		"                           (default: 5)\n"
+		"    -o erase_size=N        erase block size reported in\n"
+		"                           .fmapfs/changes (default: 4096)\n"
+		"\n"
+		"Serving a directory of images (high-level API only):\n"
+		"    -o max_images=N        images to keep loaded at once, 0\n"
+		"                           for no limit (default: 64)\n"
+		"    -o max_mapped=M        MiB of images to keep loaded at\n"
+		"                           once (default: no limit)\n"
+		"\n");
 	fuse_main(ARRAY_SIZE(argv) - 1, argv, &fmapfs_ops, NULL);
 }
 
@@ -27,9 +93,13 @@ int main(int argc, char *argv[])
 {
 	int i;
 	int rv;
+	struct stat st;
 	const char *image_path = NULL;
+	struct fuse_args args;
 	struct fmapfs_state fs_state = {
 		.arena = ARENA_INIT(),
+		.lazy_lock = PTHREAD_MUTEX_INITIALIZER,
+		.opts = FMAPFS_OPTIONS_INIT(),
 	};
 
 	bool help_requested = false;
@@ -50,11 +120,43 @@ int main(int argc, char *argv[])
 	argv[i] = argv[i + 1];
 	argv[i + 1] = NULL;
 
-	if (fmapfs_load_image(&fs_state, image_path) < 0)
+	args = (struct fuse_args)FUSE_ARGS_INIT(argc - 1, argv);
+	if (fuse_opt_parse(&args, &fs_state.opts, fmapfs_opts, NULL) < 0)
+		return 1;
+
+	if (!stat(image_path, &st) && S_ISDIR(st.st_mode)) {
+		if (fs_state.opts.lowlevel) {
+			fprintf(stderr, "%s: a directory of images can't be "
+					"served with -o lowlevel\n",
+				argv[0]);
+			rv = 1;
+		} else {
+			rv = fmapfs_multi_main(&args, image_path,
+					       &fs_state.opts);
+		}
+		fuse_opt_free_args(&args);
+		free(fs_state.opts.backend);
+		free(fs_state.opts.flush);
+		return rv;
+	}
+
+	if (fmapfs_load_image(&fs_state, image_path) < 0) {
+		fuse_opt_free_args(&args);
+		free(fs_state.opts.backend);
+		free(fs_state.opts.flush);
 		return 2;
+	}
+
+	if (fs_state.opts.lowlevel)
+		rv = fmapfs_lowlevel_main(&args, &fs_state);
+	else
+		rv = fuse_main(args.argc, args.argv, &fmapfs_ops, &fs_state);
 
-	rv = fuse_main(argc - 1, argv, &fmapfs_ops, &fs_state);
-	arena_free(&fs_state.arena);
+	/* Flushes whatever the policy hasn't yet */
+	fmapfs_unload_image(&fs_state);
+	fuse_opt_free_args(&args);
+	free(fs_state.opts.backend);
+	free(fs_state.opts.flush);
 
 	return rv;
 }
@@ -0,0 +1,647 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fuse.h>
+
+#include "arena.h"
+#include "fs.h"
+#include "log.h"
+#include "multi.h"
+#include "stats.h"
+#include "trace.h"
+#include "view.h"
+
+/*
+ * Given a directory instead of an image, one session serves every file in
+ * it as <mount>/<file>/...  Images are loaded on first access below their
+ * directory, and unloaded again, least recently used first, once more
+ * than max_images of them are loaded or they map more than max_mapped
+ * MiB.  Images read through a descriptor count towards max_images only.
+ * Open files pin the image they belong to.
+ *
+ * Only the high-level engine can do this: it resolves paths on every
+ * request, so an evicted image is simply loaded again, whereas inode
+ * numbers handed to the kernel would have to outlive their image.
+ */
+
+struct multi_loaded;
+
+struct multi_image {
+	const char *name;
+	struct multi_image *next_hash;
+
+	/* The loaded image, or NULL while evicted */
+	struct multi_loaded *loaded;
+
+	/* Requests and open files using the image, which pin it */
+	unsigned int refs;
+
+	/* Position among loaded images, most recently used first */
+	struct multi_image *lru_prev;
+	struct multi_image *lru_next;
+};
+
+struct multi_loaded {
+	/* First, so handle states lead back here */
+	struct fmapfs_state state;
+	struct multi_image *image;
+	struct multi_loaded *next_victim;
+};
+
+struct fmapfs_multi {
+	const char *dir_path;
+	int dir_fd;
+	struct fmapfs_options opts;
+	struct fuse *fuse;
+
+	/* Everything below, and the fields of every image */
+	pthread_mutex_t lock;
+
+	/* Every name seen so far, loaded or not, allocated in arena */
+	struct multi_image **buckets;
+	size_t n_buckets;
+	size_t n_images;
+	struct arena arena;
+
+	struct multi_image *lru_head;
+	struct multi_image *lru_tail;
+	size_t n_loaded;
+	size_t mapped;
+};
+
+static struct fmapfs_multi *multi_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static uint32_t multi_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name)
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+
+	return hash;
+}
+
+static struct multi_image *multi_find(struct fmapfs_multi *multi,
+				      const char *name)
+{
+	struct multi_image *image;
+
+	image = multi->buckets[multi_hash(name) & (multi->n_buckets - 1)];
+	for (; image; image = image->next_hash) {
+		if (!strcmp(image->name, name))
+			return image;
+	}
+
+	return NULL;
+}
+
+/* Keep the chains short, old bucket arrays stay in the arena */
+static void multi_grow(struct fmapfs_multi *multi)
+{
+	size_t n_buckets = multi->n_buckets * 2;
+	struct multi_image **buckets;
+
+	buckets = arena_calloc(&multi->arena, sizeof(*buckets), n_buckets);
+	for (size_t i = 0; i < multi->n_buckets; i++) {
+		struct multi_image *image = multi->buckets[i];
+
+		while (image) {
+			struct multi_image *next = image->next_hash;
+			size_t b = multi_hash(image->name) & (n_buckets - 1);
+
+			image->next_hash = buckets[b];
+			buckets[b] = image;
+			image = next;
+		}
+	}
+
+	multi->buckets = buckets;
+	multi->n_buckets = n_buckets;
+}
+
+static struct multi_image *multi_add(struct fmapfs_multi *multi,
+				     const char *name)
+{
+	struct multi_image *image;
+	size_t b;
+
+	if (multi->n_images >= multi->n_buckets)
+		multi_grow(multi);
+
+	image = arena_calloc(&multi->arena, sizeof(*image), 1);
+	image->name = arena_strdup(&multi->arena, name);
+
+	b = multi_hash(name) & (multi->n_buckets - 1);
+	image->next_hash = multi->buckets[b];
+	multi->buckets[b] = image;
+	multi->n_images++;
+
+	return image;
+}
+
+static void lru_remove(struct fmapfs_multi *multi, struct multi_image *image)
+{
+	if (image->lru_prev)
+		image->lru_prev->lru_next = image->lru_next;
+	else
+		multi->lru_head = image->lru_next;
+
+	if (image->lru_next)
+		image->lru_next->lru_prev = image->lru_prev;
+	else
+		multi->lru_tail = image->lru_prev;
+
+	image->lru_prev = NULL;
+	image->lru_next = NULL;
+}
+
+static void lru_push(struct fmapfs_multi *multi, struct multi_image *image)
+{
+	image->lru_next = multi->lru_head;
+	if (multi->lru_head)
+		multi->lru_head->lru_prev = image;
+	else
+		multi->lru_tail = image;
+	multi->lru_head = image;
+}
+
+/* Only mappings take address space, descriptors don't */
+static size_t multi_mapped_size(struct fmapfs_state *state)
+{
+	return state->image.mem ? state->image.size : 0;
+}
+
+static bool multi_over_budget(struct fmapfs_multi *multi)
+{
+	if (multi->opts.max_images && multi->n_loaded > multi->opts.max_images)
+		return true;
+
+	return multi->opts.max_mapped &&
+	       multi->mapped > (size_t)multi->opts.max_mapped << 20;
+}
+
+/*
+ * Detach unused images, least recently used first, until the loaded ones
+ * fit the budget again.  Returns them, to be unloaded without the lock.
+ */
+static struct multi_loaded *multi_evict(struct fmapfs_multi *multi)
+{
+	struct multi_image *image = multi->lru_tail;
+	struct multi_loaded *victims = NULL;
+
+	while (image && multi_over_budget(multi)) {
+		struct multi_image *prev = image->lru_prev;
+		struct multi_loaded *loaded = image->loaded;
+
+		if (!image->refs) {
+			lru_remove(multi, image);
+			image->loaded = NULL;
+			multi->n_loaded--;
+			multi->mapped -= multi_mapped_size(&loaded->state);
+
+			loaded->next_victim = victims;
+			victims = loaded;
+		}
+
+		image = prev;
+	}
+
+	return victims;
+}
+
+static void multi_unload(struct multi_loaded *victims)
+{
+	while (victims) {
+		struct multi_loaded *next = victims->next_victim;
+
+		fmapfs_log(FUSE_LOG_DEBUG, "Unloading image %s",
+			   victims->image->name);
+		fmapfs_unload_image(&victims->state);
+		free(victims);
+		victims = next;
+	}
+}
+
+/*
+ * Look up the image named by the first component of path, pinning it.
+ * The rest of the path, always starting with "/", is returned in rest.
+ * The root itself has no image: 0 is returned with *imagep set to NULL.
+ */
+static int multi_resolve(struct fmapfs_multi *multi, const char *path,
+			 struct multi_image **imagep, const char **rest)
+{
+	char name[NAME_MAX + 1];
+	struct multi_image *image;
+	size_t name_len;
+	struct stat st;
+
+	path += strspn(path, "/");
+	name_len = strcspn(path, "/");
+	*imagep = NULL;
+	*rest = path[name_len] ? path + name_len : "/";
+
+	if (!name_len)
+		return 0;
+	if (name_len > NAME_MAX)
+		return -ENAMETOOLONG;
+
+	memcpy(name, path, name_len);
+	name[name_len] = '\0';
+
+	pthread_mutex_lock(&multi->lock);
+	image = multi_find(multi, name);
+	if (!image) {
+		pthread_mutex_unlock(&multi->lock);
+
+		/* Only remember names of images that exist */
+		if (!strcmp(name, ".") || !strcmp(name, "..") ||
+		    fstatat(multi->dir_fd, name, &st, 0) < 0 ||
+		    !S_ISREG(st.st_mode))
+			return -ENOENT;
+
+		pthread_mutex_lock(&multi->lock);
+		image = multi_find(multi, name) ?: multi_add(multi, name);
+	}
+	image->refs++;
+	pthread_mutex_unlock(&multi->lock);
+
+	*imagep = image;
+	return 0;
+}
+
+/* Drop a pin, unloading images no longer needed to fit the budget */
+static void multi_put(struct fmapfs_multi *multi, struct multi_image *image)
+{
+	struct multi_loaded *victims = NULL;
+
+	if (!image)
+		return;
+
+	pthread_mutex_lock(&multi->lock);
+	if (!--image->refs)
+		victims = multi_evict(multi);
+	pthread_mutex_unlock(&multi->lock);
+
+	multi_unload(victims);
+}
+
+static struct multi_loaded *multi_load_image(struct fmapfs_multi *multi,
+					     struct multi_image *image)
+{
+	struct multi_loaded *loaded = calloc(1, sizeof(*loaded));
+	struct fmapfs_state *state;
+	char path[PATH_MAX];
+
+	if (!loaded)
+		return NULL;
+
+	loaded->image = image;
+	state = &loaded->state;
+	state->arena = (struct arena)ARENA_INIT();
+	state->opts = multi->opts;
+	pthread_mutex_init(&state->lazy_lock, NULL);
+
+	snprintf(path, sizeof(path), "%s/%s", multi->dir_path, image->name);
+	fmapfs_log(FUSE_LOG_DEBUG, "Loading image %s", path);
+	if (fmapfs_load_image(state, path) < 0) {
+		arena_free(&state->arena);
+		free(loaded);
+		return NULL;
+	}
+
+	/* Invalidate the image's files below its own directory */
+	snprintf(path, sizeof(path), "/%s", image->name);
+	state->views.path_prefix = arena_strdup(&state->arena, path);
+	state->views.fuse = multi->fuse;
+	view_map_start(&state->views);
+	flusher_start(&state->flusher);
+
+	return loaded;
+}
+
+/*
+ * The state of a pinned image, loading it if it isn't.  Images are
+ * loaded without the lock, so concurrent loads of the same image may
+ * race, in which case the first one installed is kept.
+ */
+static struct fmapfs_state *multi_load(struct fmapfs_multi *multi,
+				       struct multi_image *image)
+{
+	struct multi_loaded *victims = NULL;
+	struct multi_loaded *loaded;
+
+	pthread_mutex_lock(&multi->lock);
+	loaded = image->loaded;
+	if (loaded) {
+		lru_remove(multi, image);
+		lru_push(multi, image);
+	}
+	pthread_mutex_unlock(&multi->lock);
+
+	if (loaded)
+		return &loaded->state;
+
+	loaded = multi_load_image(multi, image);
+	if (!loaded)
+		return NULL;
+
+	pthread_mutex_lock(&multi->lock);
+	if (image->loaded) {
+		victims = loaded;
+		loaded = image->loaded;
+	} else {
+		image->loaded = loaded;
+		multi->n_loaded++;
+		multi->mapped += multi_mapped_size(&loaded->state);
+		lru_push(multi, image);
+		victims = multi_evict(multi);
+	}
+	pthread_mutex_unlock(&multi->lock);
+
+	multi_unload(victims);
+
+	return &loaded->state;
+}
+
+static struct multi_image *handle_image(struct fuse_file_info *fi)
+{
+	return ((struct multi_loaded *)fmapfs_handle_state(fi))->image;
+}
+
+static void *multi_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct fmapfs_multi *multi = multi_get();
+
+	cfg->nullpath_ok = 1;
+	cfg->hard_remove = 1;
+
+	/* Inode numbers are only unique within an image */
+	cfg->use_ino = 0;
+	cfg->entry_timeout = multi->opts.cache_timeout;
+	cfg->negative_timeout = multi->opts.cache_timeout;
+	cfg->attr_timeout = multi->opts.cache_timeout;
+
+	fmapfs_tune_conn(&multi->opts, conn);
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+
+	multi->fuse = fuse_get_context()->fuse;
+	trace_start();
+
+	return multi;
+}
+
+static void multi_destroy(void *private_data)
+{
+	struct fmapfs_multi *multi = private_data;
+	struct multi_loaded *victims = NULL;
+
+	while (multi->lru_head) {
+		struct multi_image *image = multi->lru_head;
+
+		lru_remove(multi, image);
+		image->loaded->next_victim = victims;
+		victims = image->loaded;
+		image->loaded = NULL;
+	}
+	multi->n_loaded = 0;
+	multi->mapped = 0;
+	multi_unload(victims);
+
+	trace_stop();
+}
+
+static void multi_fill_dir_stat(struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFDIR | 0750;
+	st->st_nlink = 2;
+}
+
+/* Image directories are listed without loading the images */
+static int multi_getattr_path(struct fmapfs_multi *multi, const char *path,
+			      struct stat *st)
+{
+	struct fmapfs_state *state;
+	struct multi_image *image;
+	const char *rest;
+	int rv;
+
+	rv = multi_resolve(multi, path, &image, &rest);
+	if (rv < 0)
+		return rv;
+
+	if (!image || !strcmp(rest, "/")) {
+		multi_fill_dir_stat(st);
+		multi_put(multi, image);
+		return 0;
+	}
+
+	state = multi_load(multi, image);
+	rv = state ? fmapfs_image_getattr(state, rest, st) : -EIO;
+	multi_put(multi, image);
+
+	return rv;
+}
+
+/* The root is opened without a handle, other directories pin an image */
+static int multi_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct fmapfs_multi *multi = multi_get();
+	struct fmapfs_state *state;
+	struct multi_image *image;
+	const char *rest;
+	int rv;
+
+	rv = multi_resolve(multi, path, &image, &rest);
+	if (rv < 0 || !image) {
+		fi->fh = 0;
+		return rv;
+	}
+
+	state = multi_load(multi, image);
+	rv = state ? fmapfs_image_opendir(state, rest, fi) : -EIO;
+	if (rv < 0)
+		multi_put(multi, image);
+
+	return rv;
+}
+
+static int multi_readdir_root(struct fmapfs_multi *multi, void *buffer,
+			      fuse_fill_dir_t filler)
+{
+	struct dirent *dirent;
+	DIR *dir;
+	int fd;
+
+	fd = openat(multi->dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -errno;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -errno;
+	}
+
+	/* Offsets of zero make libfuse collect the whole listing at once */
+	filler(buffer, ".", NULL, 0, 0);
+	filler(buffer, "..", NULL, 0, 0);
+	while ((dirent = readdir(dir))) {
+		struct stat st;
+
+		if (dirent->d_type == DT_UNKNOWN) {
+			if (fstatat(multi->dir_fd, dirent->d_name, &st,
+				    0) < 0 ||
+			    !S_ISREG(st.st_mode))
+				continue;
+		} else if (dirent->d_type != DT_REG) {
+			continue;
+		}
+
+		if (filler(buffer, dirent->d_name, NULL, 0, 0))
+			break;
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static int multi_readdir(const char *path, void *buffer,
+			 fuse_fill_dir_t filler, off_t offset,
+			 struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	if (fi->fh)
+		return fmapfs_ops.readdir(path, buffer, filler, offset, fi,
+					  flags);
+
+	return STATS_CALL(STATS_READDIR,
+			  multi_readdir_root(multi_get(), buffer, filler));
+}
+
+static int multi_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct multi_image *image;
+	int rv;
+
+	if (!fi->fh)
+		return 0;
+
+	image = handle_image(fi);
+	rv = fmapfs_ops.releasedir(path, fi);
+	multi_put(multi_get(), image);
+
+	return rv;
+}
+
+static int multi_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fmapfs_multi *multi = multi_get();
+	struct fmapfs_state *state;
+	struct multi_image *image;
+	const char *rest;
+	int rv;
+
+	rv = multi_resolve(multi, path, &image, &rest);
+	if (rv < 0)
+		return rv;
+	if (!image)
+		return -EISDIR;
+
+	state = multi_load(multi, image);
+	rv = state ? fmapfs_image_open(state, rest, fi) : -EIO;
+	if (rv < 0)
+		multi_put(multi, image);
+
+	return rv;
+}
+
+static int multi_release(const char *path, struct fuse_file_info *fi)
+{
+	struct multi_image *image = handle_image(fi);
+	int rv;
+
+	rv = fmapfs_ops.release(path, fi);
+	multi_put(multi_get(), image);
+
+	return rv;
+}
+
+static int multi_getattr(const char *path, struct stat *st,
+			 struct fuse_file_info *fi)
+{
+	if (fi && fi->fh)
+		return fmapfs_ops.getattr(path, st, fi);
+
+	return STATS_CALL(STATS_GETATTR,
+			  multi_getattr_path(multi_get(), path, st));
+}
+
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_OPENDIR, multi_opendir(path, fi));
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+	return STATS_CALL(STATS_OPEN, multi_open(path, fi));
+}
+
+int fmapfs_multi_main(struct fuse_args *args, const char *dir_path,
+		      struct fmapfs_options *opts)
+{
+	struct fmapfs_multi multi = {
+		.dir_path = dir_path,
+		.opts = *opts,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.arena = ARENA_INIT(),
+		.n_buckets = 64,
+	};
+	struct fuse_operations ops = fmapfs_ops;
+	int rv;
+
+	/*
+	 * Open files and directories carry their image in the handle, so
+	 * the single-image handlers serve them as they are.
+	 */
+	ops.init = multi_init;
+	ops.destroy = multi_destroy;
+	ops.getattr = multi_getattr;
+	ops.opendir = timed_opendir;
+	ops.readdir = multi_readdir;
+	ops.releasedir = multi_releasedir;
+	ops.open = timed_open;
+	ops.release = multi_release;
+
+	multi.dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+	if (multi.dir_fd < 0) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to open %s: %s", dir_path,
+			   strerror(errno));
+		return 2;
+	}
+
+	multi.buckets = arena_calloc(&multi.arena, sizeof(*multi.buckets),
+				     multi.n_buckets);
+	trace_enable(opts->trace);
+
+	rv = fuse_main(args->argc, args->argv, &ops, &multi);
+
+	close(multi.dir_fd);
+	arena_free(&multi.arena);
+
+	return rv;
+}
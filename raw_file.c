@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <fuse.h>
 #include <fmap.h>
 #include <stdio.h>
@@ -6,11 +7,13 @@
 #include <sys/types.h>
 
 #include "arena.h"
+#include "image.h"
 #include "route.h"
 #include "raw_file.h"
 
 struct raw_file_priv {
-	void *mem;
+	struct image *image;
+	off_t image_offset;
 	size_t size;
 };
 
@@ -32,8 +35,8 @@ static int raw_file_read(char *buf, size_t n_bytes, off_t offset,
 	if (n_bytes + offset >= priv->size)
 		n_bytes = priv->size - offset;
 
-	memcpy(buf, priv->mem + offset, n_bytes);
-	return n_bytes;
+	return image_read(priv->image, buf, n_bytes,
+			  priv->image_offset + offset);
 }
 
 static int raw_file_write(const char *buf, size_t n_bytes, off_t offset,
@@ -47,23 +50,109 @@ static int raw_file_write(const char *buf, size_t n_bytes, off_t offset,
 	if (n_bytes + offset >= priv->size)
 		n_bytes = priv->size - offset;
 
-	memcpy(priv->mem + offset, buf, n_bytes);
+	return image_write(priv->image, buf, n_bytes,
+			   priv->image_offset + offset);
+}
+
+static int raw_file_read_buf(struct fuse_buf *buf, size_t n_bytes,
+			     off_t offset, struct fuse_file_info *fi,
+			     void *param)
+{
+	struct raw_file_priv *priv = param;
+
+	if (offset > priv->size)
+		offset = priv->size;
+
+	if (n_bytes + offset >= priv->size)
+		n_bytes = priv->size - offset;
+
+	/* Mapped bytes, and page cache bytes which can be spliced */
+	buf->mem = priv->image->mem ?
+			   priv->image->mem + priv->image_offset + offset :
+			   NULL;
+	buf->size = n_bytes;
+	buf->fd = priv->image->fd;
+	buf->pos = priv->image_offset + offset;
 	return n_bytes;
 }
 
+/*
+ * Data arriving in a pipe (spliced from the FUSE device) is spliced
+ * straight into the image file; anything already in memory is copied
+ * into the mapping.  Without either, the data is flattened and written
+ * through the image backend.
+ */
+static int raw_file_write_buf(struct fuse_bufvec *src, off_t offset,
+			      struct fuse_file_info *fi, void *param)
+{
+	struct raw_file_priv *priv = param;
+	struct image *image = priv->image;
+	size_t n_bytes = fuse_buf_size(src);
+	struct fuse_bufvec dst;
+	ssize_t rv;
+
+	if (offset > priv->size)
+		return 0;
+
+	if (n_bytes + offset >= priv->size)
+		n_bytes = priv->size - offset;
+
+	dst = FUSE_BUFVEC_INIT(n_bytes);
+	if ((src->buf[src->idx].flags & FUSE_BUF_IS_FD) && image->fd >= 0) {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = image->fd;
+		dst.buf[0].pos = priv->image_offset + offset;
+	} else if (image->mem) {
+		dst.buf[0].mem = image->mem + priv->image_offset + offset;
+	} else {
+		dst.buf[0].mem = malloc(n_bytes);
+		if (!dst.buf[0].mem)
+			return -ENOMEM;
+
+		rv = fuse_buf_copy(&dst, src, 0);
+		if (rv > 0)
+			rv = image_write(image, dst.buf[0].mem, rv,
+					 priv->image_offset + offset);
+		free(dst.buf[0].mem);
+		return rv;
+	}
+
+	/* Bypassing the backend, so the bytes must be marked by hand */
+	rv = fuse_buf_copy(&dst, src, 0);
+	if (rv > 0)
+		image_mark_dirty(image, priv->image_offset + offset, rv);
+
+	return rv;
+}
+
+static void raw_file_get_extent(void *param, struct file_extent *extent)
+{
+	struct raw_file_priv *priv = param;
+
+	extent->offset = priv->image_offset;
+	extent->size = priv->size;
+	extent->linear = true;
+}
+
 static struct file_ops ops = {
+	.keep_cache = true,
 	.get_size = get_size,
 	.read = raw_file_read,
 	.write = raw_file_write,
+	.read_buf = raw_file_read_buf,
+	.write_buf = raw_file_write_buf,
+	.get_extent = raw_file_get_extent,
 };
 
 void add_raw_file(struct arena *arena, struct directory *basedir,
-		  const char *name, void *mem, size_t size)
+		  const char *name, struct image *image, off_t image_offset,
+		  size_t size)
 {
 	struct raw_file_priv *priv =
 		arena_malloc(arena, sizeof(struct raw_file_priv), 1);
 
-	priv->mem = mem;
+	priv->image = image;
+	priv->image_offset = image_offset;
 	priv->size = size;
 
 	route_new_file(arena, basedir, name, &ops, priv);
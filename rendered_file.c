@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+
+#include "arena.h"
+#include "rendered_file.h"
+#include "route.h"
+#include "view.h"
+
+/*
+ * Generated files (versions, flags, strings) are rendered into a buffer
+ * which serves reads and size queries until a write changes the image
+ * bytes under the file's view, bumping the view's generation.
+ */
+struct rendered_priv {
+	const struct render_ops *ops;
+	void *param;
+	struct directory_entry *entry;
+
+	pthread_mutex_t lock;
+	char *buf;
+	size_t size;
+	size_t len;
+	bool valid;
+	uint64_t generation;
+};
+
+/* Called with priv->lock held */
+static void rendered_update(struct rendered_priv *priv)
+{
+	struct view *view = priv->entry->reg_file.view;
+	uint64_t generation = 0;
+
+	/* Files without a view can't be invalidated, so never cache them */
+	if (view) {
+		generation = __atomic_load_n(&view->generation,
+					     __ATOMIC_ACQUIRE);
+		if (priv->valid && priv->generation == generation)
+			return;
+	}
+
+	priv->len = priv->ops->render(priv->buf, priv->size, priv->param);
+	priv->generation = generation;
+	priv->valid = view;
+}
+
+static size_t rendered_get_size(void *param)
+{
+	struct rendered_priv *priv = param;
+	size_t len;
+
+	pthread_mutex_lock(&priv->lock);
+	rendered_update(priv);
+	len = priv->len;
+	pthread_mutex_unlock(&priv->lock);
+
+	return len;
+}
+
+static int rendered_read(char *buf, size_t n_bytes, off_t offset,
+			 struct fuse_file_info *fi, void *param)
+{
+	struct rendered_priv *priv = param;
+
+	pthread_mutex_lock(&priv->lock);
+	rendered_update(priv);
+
+	if (offset >= priv->len)
+		n_bytes = 0;
+	else if (n_bytes > priv->len - offset)
+		n_bytes = priv->len - offset;
+
+	memcpy(buf, priv->buf + offset, n_bytes);
+	pthread_mutex_unlock(&priv->lock);
+
+	return n_bytes;
+}
+
+static int rendered_write(const char *buf, size_t n_bytes, off_t offset,
+			  struct fuse_file_info *fi, void *param)
+{
+	struct rendered_priv *priv = param;
+
+	return priv->ops->write(buf, n_bytes, offset, fi, priv->param);
+}
+
+static void rendered_get_extent(void *param, struct file_extent *extent)
+{
+	struct rendered_priv *priv = param;
+
+	priv->ops->get_extent(priv->param, extent);
+}
+
+static struct file_ops ops = {
+	.get_size = rendered_get_size,
+	.read = rendered_read,
+	.write = rendered_write,
+	.get_extent = rendered_get_extent,
+};
+
+void add_rendered_file(struct arena *arena, struct directory *basedir,
+		       const char *name, const struct render_ops *render_ops,
+		       void *param, size_t max_size)
+{
+	struct rendered_priv *priv =
+		arena_calloc(arena, sizeof(struct rendered_priv), 1);
+
+	priv->ops = render_ops;
+	priv->param = param;
+	priv->buf = arena_malloc(arena, sizeof(char), max_size);
+	priv->size = max_size;
+	pthread_mutex_init(&priv->lock, NULL);
+
+	priv->entry = route_new_file(arena, basedir, name, &ops, priv);
+}
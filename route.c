@@ -1,12 +1,18 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-
-#include <fuse_log.h>
+#include <unistd.h>
 
 #include "arena.h"
+#include "log.h"
 #include "route.h"
+#include "stats.h"
+#include "trace.h"
+#include "view.h"
 
 struct directory_entry *route_new_root(struct arena *arena)
 {
@@ -51,8 +57,10 @@ struct directory *route_new_subdirectory(struct arena *arena,
 	return subdir;
 }
 
-void route_new_file(struct arena *arena, struct directory *basedir,
-		    const char *name, struct file_ops *ops, void *param)
+struct directory_entry *route_new_file(struct arena *arena,
+				       struct directory *basedir,
+				       const char *name, struct file_ops *ops,
+				       void *param)
 {
 	struct directory_entry *entry =
 		arena_calloc(arena, sizeof(struct directory_entry), 1);
@@ -69,32 +77,505 @@ void route_new_file(struct arena *arena, struct directory *basedir,
 	entry->reg_file.param = param;
 
 	route_add_entry_to_directory(arena, basedir, entry);
+	return entry;
 }
 
-struct directory_entry *route_lookup_path(struct directory_entry *root,
-					  const char *path)
+/* FNV-1a */
+static uint32_t route_hash(const char *name, size_t name_len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < name_len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void route_freeze_dir(struct arena *arena, struct directory *dir)
+{
+	size_t count = 0;
+	size_t i = 0;
+
+	for (struct dir_list *ent = dir->entries; ent; ent = ent->next)
+		count++;
+
+	/* Keep the index at most half full so probe chains stay short */
+	dir->n_slots = 2;
+	while (dir->n_slots < count * 2)
+		dir->n_slots *= 2;
+
+	dir->children = arena_calloc(arena, sizeof(*dir->children),
+				     count ?: 1);
+	dir->slots = arena_calloc(arena, sizeof(*dir->slots), dir->n_slots);
+	dir->n_children = count;
+
+	for (struct dir_list *ent = dir->entries; ent; ent = ent->next) {
+		struct directory_entry *entry = ent->entry;
+		uint32_t hash;
+		size_t slot;
+
+		entry->name_len = strlen(entry->name);
+		hash = route_hash(entry->name, entry->name_len);
+
+		slot = hash & (dir->n_slots - 1);
+		while (dir->slots[slot].entry)
+			slot = (slot + 1) & (dir->n_slots - 1);
+
+		dir->slots[slot].hash = hash;
+		dir->slots[slot].name_len = entry->name_len;
+		dir->slots[slot].entry = entry;
+		dir->children[i++] = entry;
+
+		if (S_ISDIR(entry->mode))
+			route_freeze_dir(arena, entry->dir);
+	}
+}
+
+/*
+ * A directory never changes once frozen.  Compile every directory under
+ * root into an array of its children and a hash index, so lookups don't
+ * walk lists or measure names.  Lazy directories are frozen again once
+ * populated.
+ */
+void route_freeze(struct arena *arena, struct directory_entry *root)
+{
+	root->name_len = strlen(root->name);
+	route_freeze_dir(arena, root->dir);
+}
+
+/* The contents of a directory, populating it first if it is lazy */
+struct directory *route_get_dir(struct directory_entry *entry)
 {
-	size_t word_len;
+	struct directory *dir = entry->dir;
 
-	fuse_log(FUSE_LOG_DEBUG, "Lookup %s in %s", path, root->name);
+	if (dir->populate &&
+	    !__atomic_load_n(&dir->populated, __ATOMIC_ACQUIRE))
+		dir->populate(entry, dir->populate_param);
 
-	path += strspn(path, "/");
-	word_len = strcspn(path, "/");
+	return dir;
+}
 
-	if (!word_len)
-		return root;
+struct directory_entry *route_lookup_child(struct directory_entry *dir,
+					   const char *name, size_t name_len)
+{
+	struct directory *d;
+	uint32_t hash;
+	size_t slot;
 
-	if (!S_ISDIR(root->mode))
+	if (!S_ISDIR(dir->mode))
 		return NULL;
 
-	for (struct dir_list *ent = root->dir->entries; ent; ent = ent->next) {
+	d = route_get_dir(dir);
+	hash = route_hash(name, name_len);
+
+	for (slot = hash & (d->n_slots - 1); d->slots[slot].entry;
+	     slot = (slot + 1) & (d->n_slots - 1)) {
+		struct dir_slot *s = &d->slots[slot];
+
 		/* Disallow partial-path matches */
-		if (word_len != strlen(ent->entry->name))
+		if (s->hash == hash && s->name_len == name_len &&
+		    !memcmp(s->entry->name, name, name_len))
+			return s->entry;
+	}
+
+	return NULL;
+}
+
+struct directory_entry *route_lookup_path(struct directory_entry *root,
+					  const char *path)
+{
+	struct directory_entry *entry = root;
+
+	fmapfs_log(FUSE_LOG_DEBUG, "Lookup %s in %s", path, root->name);
+
+	while (entry) {
+		size_t word_len;
+
+		path += strspn(path, "/");
+		word_len = strcspn(path, "/");
+		if (!word_len)
+			break;
+
+		entry = route_lookup_child(entry, path, word_len);
+		path += word_len;
+	}
+
+	return entry;
+}
+
+static struct path_table *route_new_path_table(struct arena *arena,
+						size_t n_entries)
+{
+	size_t n_slots = 2;
+	struct path_table *table;
+
+	while (n_slots < n_entries * 2)
+		n_slots *= 2;
+	table = arena_calloc(arena, sizeof(*table) +
+				    n_slots * sizeof(table->slots[0]), 1);
+	table->n_slots = n_slots;
+
+	return table;
+}
+
+/* Readers may be probing the table, so the entry is stored last */
+static void route_insert_path(struct path_table *table,
+			      const struct path_slot *path)
+{
+	size_t slot = path->hash & (table->n_slots - 1);
+
+	while (table->slots[slot].entry)
+		slot = (slot + 1) & (table->n_slots - 1);
+
+	table->slots[slot].hash = path->hash;
+	table->slots[slot].path_len = path->path_len;
+	table->slots[slot].path = path->path;
+	__atomic_store_n(&table->slots[slot].entry, path->entry,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Index the absolute path of every entry.  Paths from the high-level API
+ * are always in this canonical form, so a lookup is a single probe.
+ */
+void route_build_path_index(struct arena *arena, struct path_index *index,
+			    struct inode_table *inodes)
+{
+	index->table = route_new_path_table(arena, inodes->n_inodes);
+	index->n_used = 0;
+	route_extend_path_index(arena, index, inodes, 1);
+}
+
+/*
+ * Index the entries numbered from first on, as route_extend_inode_table()
+ * returns them.  Writers are serialized by the caller, lookups may run
+ * concurrently and simply miss entries not indexed yet.
+ */
+void route_extend_path_index(struct arena *arena, struct path_index *index,
+			     struct inode_table *inodes, size_t first)
+{
+	size_t n_inodes = inodes->n_inodes;
+	struct path_table *table = index->table;
+	size_t needed = index->n_used + n_inodes + 1 - first;
+	char path[PATH_MAX];
+
+	if (needed * 2 > table->n_slots) {
+		struct path_table *grown = route_new_path_table(arena, needed);
+
+		for (size_t slot = 0; slot < table->n_slots; slot++) {
+			if (table->slots[slot].entry)
+				route_insert_path(grown, &table->slots[slot]);
+		}
+		__atomic_store_n(&index->table, grown, __ATOMIC_RELEASE);
+		table = grown;
+	}
+
+	for (size_t ino = first; ino <= n_inodes; ino++) {
+		int len = route_get_path(inodes->entries[ino], path,
+					 sizeof(path));
+
+		if (len < 0)
 			continue;
 
-		if (!strncmp(ent->entry->name, path, word_len))
-			return route_lookup_path(ent->entry, path + word_len);
+		route_insert_path(table, &(struct path_slot){
+			.hash = route_hash(path, len),
+			.path_len = len,
+			.path = arena_strdup(arena, path),
+			.entry = inodes->entries[ino],
+		});
+		index->n_used++;
 	}
+}
 
-	return NULL;
+/*
+ * Look up a path in the index, falling back to walking the tree for
+ * paths that aren't in canonical form, aren't populated yet, or don't
+ * exist.  Both are counted in .fmapfs/stats, but not timed.
+ */
+struct directory_entry *route_lookup_indexed(struct path_index *index,
+					     struct directory_entry *root,
+					     const char *path)
+{
+	struct path_table *table = __atomic_load_n(&index->table,
+						   __ATOMIC_ACQUIRE);
+	size_t mask = table->n_slots - 1;
+	size_t path_len = strlen(path);
+	uint32_t hash = route_hash(path, path_len);
+	struct directory_entry *entry;
+
+	for (size_t slot = hash & mask;
+	     (entry = __atomic_load_n(&table->slots[slot].entry,
+				      __ATOMIC_ACQUIRE));
+	     slot = (slot + 1) & mask) {
+		struct path_slot *s = &table->slots[slot];
+
+		if (s->hash == hash && s->path_len == path_len &&
+		    !memcmp(s->path, path, path_len)) {
+			stats_count(STATS_PATH_INDEX_HIT);
+			return entry;
+		}
+	}
+
+	stats_count(STATS_PATH_INDEX_MISS);
+	return route_lookup_path(root, path);
+}
+
+static size_t route_count_entries(struct directory_entry *entry)
+{
+	size_t count = 1;
+
+	if (!S_ISDIR(entry->mode))
+		return count;
+
+	for (struct dir_list *ent = entry->dir->entries; ent; ent = ent->next)
+		count += route_count_entries(ent->entry);
+
+	return count;
+}
+
+static void route_number_entries(struct directory_entry *entry,
+				 struct directory_entry *parent,
+				 struct directory_entry **table, size_t *next)
+{
+	entry->ino = (*next)++;
+	entry->parent = parent;
+	table[entry->ino] = entry;
+
+	entry->st.st_ino = entry->ino;
+	entry->st.st_mode = entry->mode;
+	entry->st.st_uid = geteuid();
+	entry->st.st_gid = getegid();
+
+	/* TODO: don't hardcode this? */
+	if (S_ISDIR(entry->mode)) {
+		entry->st.st_nlink = 2;
+	} else {
+		entry->st.st_nlink = 1;
+		entry->st.st_size = -1;
+	}
+
+	if (!S_ISDIR(entry->mode))
+		return;
+
+	for (struct dir_list *ent = entry->dir->entries; ent; ent = ent->next)
+		route_number_entries(ent->entry, entry, table, next);
+}
+
+/*
+ * Assign stable inode numbers to every entry in the tree, starting with
+ * the root at inode 1.  The root is its own parent.
+ */
+void route_build_inode_table(struct arena *arena, struct inode_table *table,
+			     struct directory_entry *root)
+{
+	size_t count = route_count_entries(root);
+	size_t next = 1;
+
+	table->capacity = count + 1;
+	table->entries = arena_calloc(arena, sizeof(struct directory_entry *),
+				      table->capacity);
+	route_number_entries(root, root, table->entries, &next);
+	table->n_inodes = count;
+}
+
+/*
+ * Number the entries of a directory populated after the table was built,
+ * growing the table as needed.  Callers must serialize extensions, but
+ * route_get_inode() may run concurrently.  Returns the first new inode.
+ */
+size_t route_extend_inode_table(struct arena *arena, struct inode_table *table,
+				struct directory_entry *dir)
+{
+	size_t first = table->n_inodes + 1;
+	size_t next = first;
+	size_t needed = first;
+
+	for (struct dir_list *ent = dir->dir->entries; ent; ent = ent->next)
+		needed += route_count_entries(ent->entry);
+
+	/* Double, so populating every directory copies O(n) pointers */
+	if (needed > table->capacity) {
+		size_t capacity = table->capacity * 2;
+		struct directory_entry **entries;
+
+		if (capacity < needed)
+			capacity = needed;
+		entries = arena_calloc(arena, sizeof(*entries), capacity);
+		memcpy(entries, table->entries, first * sizeof(*entries));
+		__atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+		table->capacity = capacity;
+	}
+
+	for (struct dir_list *ent = dir->dir->entries; ent; ent = ent->next)
+		route_number_entries(ent->entry, dir, table->entries, &next);
+	__atomic_store_n(&table->n_inodes, next - 1, __ATOMIC_RELEASE);
+
+	return first;
+}
+
+struct directory_entry *route_get_inode(struct inode_table *table,
+					uint64_t ino)
+{
+	size_t n_inodes = __atomic_load_n(&table->n_inodes, __ATOMIC_ACQUIRE);
+
+	if (!ino || ino > n_inodes)
+		return NULL;
+
+	return __atomic_load_n(&table->entries, __ATOMIC_ACQUIRE)[ino];
+}
+
+static off_t route_compute_size(struct directory_entry *entry)
+{
+	struct file_ops *ops = entry->reg_file.ops;
+	void *param = entry->reg_file.param;
+	off_t size = 0;
+
+	if (ops->get_size) {
+		uint64_t start = stats_start();
+
+		size = ops->get_size(param);
+		stats_end(STATS_FILE_GET_SIZE, start, 0);
+	} else if (ops->read) {
+		char buf[1024];
+		size_t bytes_read;
+
+		do {
+			bytes_read = STATS_CALL(STATS_FILE_READ,
+						ops->read(buf, sizeof(buf),
+							  size, NULL, param));
+			size += bytes_read;
+		} while (bytes_read == sizeof(buf));
+	}
+
+	return size;
+}
+
+/*
+ * Copy the precomputed attributes of an entry, computing the size of a
+ * file only when it isn't cached.  The size is stored while the view is
+ * still locked, and writers invalidate it only after unlocking, so a
+ * stale size is never left behind.
+ */
+void route_fill_stat(struct directory_entry *entry, struct stat *st)
+{
+	off_t size;
+
+	*st = entry->st;
+	if (!S_ISREG(entry->mode))
+		return;
+
+	size = __atomic_load_n(&entry->st.st_size, __ATOMIC_ACQUIRE);
+	if (size < 0) {
+		uint64_t locked = view_lock(entry->reg_file.view, 0, SIZE_MAX,
+					    false);
+
+		size = route_compute_size(entry);
+		__atomic_store_n(&entry->st.st_size, size, __ATOMIC_RELEASE);
+		view_unlock(entry->reg_file.view, locked);
+	}
+
+	st->st_size = size;
+}
+
+void route_invalidate_stat(struct directory_entry *entry)
+{
+	if (S_ISREG(entry->mode))
+		__atomic_store_n(&entry->st.st_size, -1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the absolute path of an entry to buf.  Returns the length of the
+ * path, or -1 if it doesn't fit.
+ */
+int route_get_path(struct directory_entry *entry, char *buf, size_t size)
+{
+	int len;
+
+	if (entry->parent == entry) {
+		if (size < 2)
+			return -1;
+		strcpy(buf, "/");
+		return 1;
+	}
+
+	len = route_get_path(entry->parent, buf, size);
+	if (len < 0)
+		return -1;
+
+	if (len > 1)
+		buf[len++] = '/';
+
+	if (len + entry->name_len + 1 > size)
+		return -1;
+
+	memcpy(buf + len, entry->name, entry->name_len + 1);
+	return len + entry->name_len;
+}
+
+/*
+ * Write a buffer vector to a file, using its write_buf operation when it
+ * has one and flattening the data for the plain write operation
+ * otherwise.
+ */
+int route_write_buf(struct directory_entry *entry, struct fuse_bufvec *src,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	struct file_ops *ops = entry->reg_file.ops;
+	size_t size = fuse_buf_size(src);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t copied;
+	int rv;
+
+	if (ops->write_buf)
+		return TRACE_CALL(STATS_FILE_WRITE_BUF, entry, offset, size,
+				  ops->write_buf(src, offset, fi,
+						 entry->reg_file.param));
+
+	if (!ops->write)
+		return -EOPNOTSUPP;
+
+	if (src->count == 1 && !src->idx && !src->off &&
+	    !(src->buf[0].flags & FUSE_BUF_IS_FD))
+		return TRACE_CALL(STATS_FILE_WRITE, entry, offset, size,
+				  ops->write(src->buf[0].mem,
+					     src->buf[0].size, offset, fi,
+					     entry->reg_file.param));
+
+	dst.buf[0].mem = malloc(size);
+	if (!dst.buf[0].mem)
+		return -ENOMEM;
+
+	copied = fuse_buf_copy(&dst, src, 0);
+	if (copied < 0)
+		rv = copied;
+	else
+		rv = TRACE_CALL(STATS_FILE_WRITE, entry, offset, copied,
+				ops->write(dst.buf[0].mem, copied, offset, fi,
+					   entry->reg_file.param));
+
+	free(dst.buf[0].mem);
+	return rv;
+}
+
+/* Set up the file's own state for the handle, whose entry is set */
+int route_open_file(struct open_file *handle)
+{
+	struct directory_entry *entry = handle->entry;
+
+	if (!entry->reg_file.ops->open)
+		return 0;
+
+	return entry->reg_file.ops->open(&handle->priv, entry->reg_file.param);
+}
+
+void route_release_file(struct open_file *handle)
+{
+	struct directory_entry *entry = handle->entry;
+
+	if (entry->reg_file.ops->release)
+		entry->reg_file.ops->release(handle->priv,
+					     entry->reg_file.param);
+	handle->priv = NULL;
 }
@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+
+#include "arena.h"
+#include "route.h"
+#include "snapshot_file.h"
+
+struct snapshot_file {
+	int (*print)(FILE *out, void *param);
+	void *param;
+};
+
+/* One per open */
+struct snapshot {
+	char *buf;
+	size_t len;
+};
+
+static size_t snapshot_get_size(void *param)
+{
+	/* Read with direct I/O, so the size is never used */
+	return 0;
+}
+
+static int snapshot_open(void **priv, void *param)
+{
+	struct snapshot_file *file = param;
+	struct snapshot *snapshot = calloc(1, sizeof(*snapshot));
+	FILE *out;
+	int rv;
+
+	if (!snapshot)
+		return -ENOMEM;
+
+	out = open_memstream(&snapshot->buf, &snapshot->len);
+	if (!out) {
+		free(snapshot);
+		return -ENOMEM;
+	}
+
+	rv = file->print(out, file->param);
+	if (fclose(out) && !rv)
+		rv = -ENOMEM;
+	if (rv < 0) {
+		free(snapshot->buf);
+		free(snapshot);
+		return rv;
+	}
+
+	*priv = snapshot;
+	return 0;
+}
+
+static void snapshot_release(void *priv, void *param)
+{
+	struct snapshot *snapshot = priv;
+
+	free(snapshot->buf);
+	free(snapshot);
+}
+
+static int snapshot_read(char *buf, size_t n_bytes, off_t offset,
+			 struct fuse_file_info *fi, void *param)
+{
+	struct snapshot *snapshot = route_file_priv(fi);
+
+	if (offset >= snapshot->len)
+		return 0;
+	if (n_bytes > snapshot->len - offset)
+		n_bytes = snapshot->len - offset;
+
+	memcpy(buf, snapshot->buf + offset, n_bytes);
+	return n_bytes;
+}
+
+static struct file_ops snapshot_ops = {
+	.direct_io = true,
+	.get_size = snapshot_get_size,
+	.read = snapshot_read,
+	.open = snapshot_open,
+	.release = snapshot_release,
+};
+
+void add_snapshot_file(struct arena *arena, struct directory *basedir,
+		       const char *name,
+		       int (*print)(FILE *out, void *param), void *param)
+{
+	struct snapshot_file *file =
+		arena_calloc(arena, sizeof(struct snapshot_file), 1);
+
+	file->print = print;
+	file->param = param;
+
+	route_new_file(arena, basedir, name, &snapshot_ops, file);
+}
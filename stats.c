@@ -0,0 +1,256 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+
+#include "arena.h"
+#include "route.h"
+#include "snapshot_file.h"
+#include "stats.h"
+
+/*
+ * Every thread counts into its own block, so recording an operation is
+ * a couple of uncontended stores.  Readers of .fmapfs/stats sum the
+ * blocks of all live threads and of the threads which have exited.
+ * Resetting records a baseline which is subtracted from later reads.
+ */
+
+/* Bucket N counts latencies in [2^N, 2^(N+1)) nanoseconds */
+#define STATS_BUCKETS 40
+
+struct stats_counters {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t hist[STATS_BUCKETS];
+};
+
+struct stats_thread {
+	struct stats_counters counters[STATS_N_OPS];
+	struct stats_thread *next;
+};
+
+static const char *const stats_op_names[STATS_N_OPS] = {
+	[STATS_GETATTR] = "getattr",
+	[STATS_OPENDIR] = "opendir",
+	[STATS_READDIR] = "readdir",
+	[STATS_RELEASEDIR] = "releasedir",
+	[STATS_OPEN] = "open",
+	[STATS_RELEASE] = "release",
+	[STATS_READ] = "read",
+	[STATS_READ_BUF] = "read_buf",
+	[STATS_WRITE] = "write",
+	[STATS_WRITE_BUF] = "write_buf",
+	[STATS_FLUSH] = "flush",
+	[STATS_FSYNC] = "fsync",
+	[STATS_FILE_GET_SIZE] = "file_get_size",
+	[STATS_FILE_READ] = "file_read",
+	[STATS_FILE_READ_BUF] = "file_read_buf",
+	[STATS_FILE_WRITE] = "file_write",
+	[STATS_FILE_WRITE_BUF] = "file_write_buf",
+	[STATS_FLUSH_RUN] = "flush_run",
+	[STATS_PATH_INDEX_HIT] = "path_index_hit",
+	[STATS_PATH_INDEX_MISS] = "path_index_miss",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct stats_thread *stats_threads;
+static struct stats_counters stats_retired[STATS_N_OPS];
+static struct stats_counters stats_baseline[STATS_N_OPS];
+static __thread struct stats_thread *stats_self;
+
+static void stats_add(struct stats_counters *dst,
+		      const struct stats_counters *src)
+{
+	dst->ops += __atomic_load_n(&src->ops, __ATOMIC_RELAXED);
+	dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+	dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+	for (int i = 0; i < STATS_BUCKETS; i++)
+		dst->hist[i] += __atomic_load_n(&src->hist[i],
+						__ATOMIC_RELAXED);
+}
+
+/* Fold the counters of an exiting thread into the retired totals */
+static void stats_thread_exit(void *arg)
+{
+	struct stats_thread *self = arg;
+
+	pthread_mutex_lock(&stats_lock);
+	for (struct stats_thread **p = &stats_threads; *p; p = &(*p)->next) {
+		if (*p == self) {
+			*p = self->next;
+			break;
+		}
+	}
+	for (int op = 0; op < STATS_N_OPS; op++)
+		stats_add(&stats_retired[op], &self->counters[op]);
+	pthread_mutex_unlock(&stats_lock);
+
+	free(self);
+}
+
+static void stats_init_key(void)
+{
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_thread *stats_thread_get(void)
+{
+	struct stats_thread *self = stats_self;
+
+	if (self)
+		return self;
+
+	self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	pthread_once(&stats_once, stats_init_key);
+	pthread_setspecific(stats_key, self);
+
+	pthread_mutex_lock(&stats_lock);
+	self->next = stats_threads;
+	stats_threads = self;
+	pthread_mutex_unlock(&stats_lock);
+
+	stats_self = self;
+	return self;
+}
+
+/* Only the owning thread writes its counters, so no atomic RMW needed */
+static inline void stats_inc(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void stats_end(enum stats_op op, uint64_t start, int64_t rv)
+{
+	struct stats_thread *self = stats_thread_get();
+	struct stats_counters *c;
+	uint64_t elapsed = stats_start() - start;
+	int bucket = 63 - __builtin_clzll(elapsed | 1);
+
+	if (!self)
+		return;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	c = &self->counters[op];
+	stats_inc(&c->ops, 1);
+	stats_inc(&c->hist[bucket], 1);
+	if (rv < 0)
+		stats_inc(&c->errors, 1);
+	else
+		stats_inc(&c->bytes, rv);
+}
+
+void stats_count(enum stats_op op)
+{
+	struct stats_thread *self = stats_thread_get();
+
+	if (self)
+		stats_inc(&self->counters[op].ops, 1);
+}
+
+/* Called with stats_lock held */
+static void stats_sum(struct stats_counters *totals)
+{
+	memcpy(totals, stats_retired, sizeof(stats_retired));
+	for (struct stats_thread *t = stats_threads; t; t = t->next) {
+		for (int op = 0; op < STATS_N_OPS; op++)
+			stats_add(&totals[op], &t->counters[op]);
+	}
+}
+
+/* Upper bound of the bucket holding the given percentile, in ns */
+static uint64_t stats_percentile(const struct stats_counters *c, int pct)
+{
+	uint64_t target = (c->ops * pct + 99) / 100;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += c->hist[i];
+		if (seen >= target)
+			return (uint64_t)2 << i;
+	}
+
+	return 0;
+}
+
+static int stats_print(FILE *out, void *param)
+{
+	struct stats_counters totals[STATS_N_OPS];
+
+	pthread_mutex_lock(&stats_lock);
+	stats_sum(totals);
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		struct stats_counters *c = &totals[op];
+		struct stats_counters *base = &stats_baseline[op];
+
+		c->ops -= base->ops;
+		c->bytes -= base->bytes;
+		c->errors -= base->errors;
+		for (int i = 0; i < STATS_BUCKETS; i++)
+			c->hist[i] -= base->hist[i];
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	fprintf(out, "# op ops bytes errors p50_ns p99_ns "
+		     "hist=log2_ns:count,...\n");
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		struct stats_counters *c = &totals[op];
+		const char *sep = "";
+
+		fprintf(out, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+			     " %" PRIu64 " hist=",
+			stats_op_names[op], c->ops, c->bytes, c->errors,
+			stats_percentile(c, 50), stats_percentile(c, 99));
+		for (int i = 0; i < STATS_BUCKETS; i++) {
+			if (!c->hist[i])
+				continue;
+			fprintf(out, "%s%d:%" PRIu64, sep, i, c->hist[i]);
+			sep = ",";
+		}
+		fputc('\n', out);
+	}
+
+	return 0;
+}
+
+static size_t stats_get_size(void *param)
+{
+	/* Read with direct I/O, so the size is never used */
+	return 0;
+}
+
+static int stats_reset(const char *buf, size_t n_bytes, off_t offset,
+		       struct fuse_file_info *fi, void *param)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_sum(stats_baseline);
+	pthread_mutex_unlock(&stats_lock);
+
+	return n_bytes;
+}
+
+static struct file_ops reset_ops = {
+	.direct_io = true,
+	.get_size = stats_get_size,
+	.write = stats_reset,
+};
+
+void add_stats_files(struct arena *arena, struct directory *basedir)
+{
+	add_snapshot_file(arena, basedir, "stats", stats_print, NULL);
+	route_new_file(arena, basedir, "reset", &reset_ops, NULL);
+}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <fmap.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -6,52 +7,36 @@
 #include <sys/types.h>
 
 #include <fuse.h>
-#include <fuse_log.h>
 
 #include "arena.h"
+#include "image.h"
+#include "log.h"
+#include "rendered_file.h"
 #include "route.h"
 #include "str_file.h"
 
 struct str_file_priv {
-	char *str;
+	struct image *image;
+	off_t image_offset;
 	size_t max_size;
 	bool add_newline;
 };
 
-static size_t get_size(void *param)
+/* Render buffers hold max_size + 1 bytes, the whole field and a newline */
+static size_t str_file_render(char *buf, size_t size, void *param)
 {
 	struct str_file_priv *priv = param;
+	size_t len;
 
-	return strnlen(priv->str, priv->max_size) + priv->add_newline;
-}
-
-static int str_file_read(char *buf, size_t n_bytes, off_t offset,
-			 struct fuse_file_info *fi, void *param)
-{
-	struct str_file_priv *priv = param;
-	size_t size = get_size(priv);
-
-	if (offset > size)
-		return 0;
-
-	if (n_bytes + offset >= size)
-		n_bytes = size - offset;
-
-	if (!n_bytes)
+	if (image_read(priv->image, buf, priv->max_size,
+		       priv->image_offset) < 0)
 		return 0;
 
-	if (offset + n_bytes == size) {
-		memcpy(buf, priv->str + offset, n_bytes - 1);
-		buf[n_bytes - 1] = '\n';
-	} else {
-		fuse_log(
-			FUSE_LOG_DEBUG,
-			"Newline not added (offset=%zu, n_bytes=%zu, size=%zu)",
-			offset, n_bytes, size);
-		memcpy(buf, priv->str + offset, n_bytes);
-	}
+	len = strnlen(buf, priv->max_size);
+	if (priv->add_newline)
+		buf[len++] = '\n';
 
-	return n_bytes;
+	return len;
 }
 
 static int str_file_write(const char *buf, size_t n_bytes, off_t offset,
@@ -60,6 +45,8 @@ static int str_file_write(const char *buf, size_t n_bytes, off_t offset,
 	struct str_file_priv *priv = param;
 	size_t len;
 	bool newline_chomped = false;
+	char *field;
+	ssize_t rv;
 
 	if (offset >= priv->max_size)
 		return 0;
@@ -67,7 +54,7 @@ static int str_file_write(const char *buf, size_t n_bytes, off_t offset,
 	len = strnlen(buf, n_bytes);
 
 	if (priv->add_newline && len && buf[len - 1] == '\n') {
-		fuse_log(FUSE_LOG_DEBUG, "chomped newline on write");
+		fmapfs_log(FUSE_LOG_DEBUG, "chomped newline on write");
 		n_bytes -= 1;
 		newline_chomped = true;
 	}
@@ -75,29 +62,48 @@ static int str_file_write(const char *buf, size_t n_bytes, off_t offset,
 	if (n_bytes + offset >= priv->max_size)
 		n_bytes = priv->max_size - offset;
 
-	memcpy(priv->str + offset, buf, n_bytes);
-	memset(priv->str + offset + n_bytes, 0,
-	       priv->max_size - n_bytes - offset);
+	/* The rest of the field is cleared, so it's written in one go */
+	field = calloc(1, priv->max_size - offset);
+	if (!field)
+		return -ENOMEM;
+
+	memcpy(field, buf, n_bytes);
+	rv = image_write(priv->image, field, priv->max_size - offset,
+			 priv->image_offset + offset);
+	free(field);
+	if (rv < 0)
+		return rv;
 
 	return n_bytes + newline_chomped;
 }
 
-static struct file_ops ops = {
-	.get_size = get_size,
-	.read = str_file_read,
+static void str_file_get_extent(void *param, struct file_extent *extent)
+{
+	struct str_file_priv *priv = param;
+
+	/* Writes clear the rest of the string */
+	extent->offset = priv->image_offset;
+	extent->size = priv->max_size;
+	extent->linear = false;
+}
+
+static const struct render_ops ops = {
+	.render = str_file_render,
 	.write = str_file_write,
+	.get_extent = str_file_get_extent,
 };
 
 void add_str_file(struct arena *arena, struct directory *basedir,
-		  const char *name, char *str, size_t max_size,
-		  bool add_newline)
+		  const char *name, struct image *image, off_t image_offset,
+		  size_t max_size, bool add_newline)
 {
 	struct str_file_priv *priv =
 		arena_malloc(arena, sizeof(struct str_file_priv), 1);
 
-	priv->str = str;
+	priv->image = image;
+	priv->image_offset = image_offset;
 	priv->max_size = max_size;
 	priv->add_newline = add_newline;
 
-	route_new_file(arena, basedir, name, &ops, priv);
+	add_rendered_file(arena, basedir, name, &ops, priv, max_size + 1);
 }
@@ -0,0 +1,249 @@
+"""Mounted throughput and latency benchmarks.
+
+Mounts the bundled images and a few synthetic ones, runs read, write and
+stat workloads through the kernel, and writes the results as JSON so runs
+can be compared across releases and mount options:
+
+    python3 tests/bench_e2e.py --program build/fmapfs --output results.json
+"""
+
+import argparse
+import concurrent.futures
+import contextlib
+import json
+import os
+import pathlib
+import platform
+import random
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+from test_e2e import HERE, decompress_image, mounted_image
+
+DEFAULT_OPTIONS = ["", "-o lowlevel"]
+
+CHUNK_SIZE = 1 << 20
+RANDOM_IO_SIZE = 4096
+
+
+def synthetic_image(program, *args):
+    """Generate an image with fmapgen, which is built next to fmapfs."""
+    with tempfile.TemporaryDirectory() as tmp:
+        path = pathlib.Path(tmp) / "synthetic.bin"
+        subprocess.run([program.parent / "fmapgen", *args, path], check=True)
+        return path.read_bytes()
+
+
+IMAGES = {
+    "elm-ap": lambda program: decompress_image(
+        HERE / "data" / "bios-elm.ro-8438-140-0.rw-8438-184-0.bin.xz"
+    ),
+    "elm-ec": lambda program: decompress_image(
+        HERE / "data" / "ec-elm.ro-1-1-4818.rw-1-1-4824.bin.xz"
+    ),
+    "synthetic-large": lambda program: synthetic_image(
+        program, "-s", "128M", "-n", "4", "-f"
+    ),
+    "synthetic-many": lambda program: synthetic_image(
+        program, "-s", "64M", "-n", "4096", "-d", "2", "-g", "-v", "-c"
+    ),
+}
+
+
+def percentile(samples, pct):
+    samples = sorted(samples)
+    return samples[min(len(samples) - 1, len(samples) * pct // 100)]
+
+
+def drop_cache(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def raw_files(mountpoint):
+    files = []
+    for area in sorted((mountpoint / "areas").iterdir()):
+        raw = area / "raw"
+        size = raw.stat().st_size
+        if size:
+            files.append((raw, size))
+    return files
+
+
+def bench_seq_read(mountpoint, files):
+    total = 0
+    start = time.perf_counter()
+    for raw, _ in files:
+        drop_cache(raw)
+        with open(raw, "rb", buffering=0) as f:
+            while chunk := f.read(CHUNK_SIZE):
+                total += len(chunk)
+    elapsed = time.perf_counter() - start
+    return {"seq_read_mib_s": total / elapsed / (1 << 20)}
+
+
+def bench_seq_write(mountpoint, files):
+    total = 0
+    elapsed = 0.0
+    for raw, _ in files:
+        data = raw.read_bytes()
+        start = time.perf_counter()
+        with open(raw, "r+b", buffering=0) as f:
+            for offset in range(0, len(data), CHUNK_SIZE):
+                total += f.write(data[offset : offset + CHUNK_SIZE])
+        elapsed += time.perf_counter() - start
+    return {"seq_write_mib_s": total / elapsed / (1 << 20)}
+
+
+def random_io(raw, size, iterations, write):
+    rng = random.Random(1)
+    latencies = []
+    fd = os.open(raw, os.O_RDWR)
+    try:
+        for _ in range(iterations):
+            offset = rng.randrange(max(1, size - RANDOM_IO_SIZE))
+            data = os.pread(fd, RANDOM_IO_SIZE, offset)
+            start = time.perf_counter()
+            if write:
+                os.pwrite(fd, data, offset)
+            else:
+                os.pread(fd, RANDOM_IO_SIZE, offset)
+            latencies.append(time.perf_counter() - start)
+    finally:
+        os.close(fd)
+    return latencies
+
+
+def bench_random(mountpoint, files, iterations):
+    raw, size = max(files, key=lambda f: f[1])
+    results = {}
+    for name, write in [("rand_read", False), ("rand_write", True)]:
+        latencies = random_io(raw, size, iterations, write)
+        results[name + "_iops"] = len(latencies) / sum(latencies)
+        results[name + "_p50_us"] = percentile(latencies, 50) * 1e6
+        results[name + "_p99_us"] = percentile(latencies, 99) * 1e6
+    return results
+
+
+def bench_stat(mountpoint, files, iterations):
+    paths = [mountpoint / "areas"]
+    for area in (mountpoint / "areas").iterdir():
+        paths.append(area)
+        paths.extend(area.iterdir())
+
+    count = 0
+    start = time.perf_counter()
+    while count < iterations:
+        for path in paths:
+            os.stat(path)
+        os.listdir(mountpoint / "areas")
+        count += len(paths) + 1
+    elapsed = time.perf_counter() - start
+    return {"stat_ops_s": count / elapsed}
+
+
+def bench_concurrent_read(mountpoint, files, readers):
+    raw, size = max(files, key=lambda f: f[1])
+
+    def read_all(index):
+        total = 0
+        with open(raw, "rb", buffering=0) as f:
+            # Start each reader at a different place in the file
+            f.seek(size * index // readers // CHUNK_SIZE * CHUNK_SIZE)
+            while chunk := f.read(CHUNK_SIZE):
+                total += len(chunk)
+        return total
+
+    drop_cache(raw)
+    start = time.perf_counter()
+    with concurrent.futures.ThreadPoolExecutor(readers) as pool:
+        total = sum(pool.map(read_all, range(readers)))
+    elapsed = time.perf_counter() - start
+    return {"concurrent_read_mib_s": total / elapsed / (1 << 20)}
+
+
+def run_benchmarks(program, name, image, options, args):
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp_path = pathlib.Path(tmp)
+        image_path = tmp_path / (name + ".bin")
+        image_path.write_bytes(image)
+
+        with contextlib.contextmanager(mounted_image)(
+            program, image_path, tmp_path, shlex.split(options)
+        ) as mountpoint:
+            files = raw_files(mountpoint)
+            results = {}
+            results.update(bench_seq_read(mountpoint, files))
+            results.update(bench_seq_write(mountpoint, files))
+            results.update(bench_random(mountpoint, files, args.iterations))
+            results.update(bench_stat(mountpoint, files, args.iterations))
+            results.update(
+                bench_concurrent_read(mountpoint, files, args.readers)
+            )
+            return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--program",
+        type=pathlib.Path,
+        default=(HERE / ".." / "build" / "fmapfs").resolve(),
+    )
+    parser.add_argument(
+        "--output",
+        type=argparse.FileType("w"),
+        default=sys.stdout,
+    )
+    parser.add_argument(
+        "--options",
+        action="append",
+        help='mount options to compare, e.g. "-o lowlevel" (repeatable)',
+    )
+    parser.add_argument(
+        "--image",
+        action="append",
+        choices=sorted(IMAGES),
+        help="images to mount (repeatable, default all)",
+    )
+    parser.add_argument("--iterations", type=int, default=2000)
+    parser.add_argument("--readers", type=int, default=4)
+    args = parser.parse_args()
+
+    runs = []
+    for name in args.image or sorted(IMAGES):
+        image = IMAGES[name](args.program)
+        for options in args.options or DEFAULT_OPTIONS:
+            print(f"{name} [{options}]", file=sys.stderr)
+            runs.append(
+                {
+                    "image": name,
+                    "image_size": len(image),
+                    "options": options,
+                    "results": run_benchmarks(
+                        args.program, name, image, options, args
+                    ),
+                }
+            )
+
+    json.dump(
+        {
+            "program": str(args.program),
+            "kernel": platform.release(),
+            "timestamp": time.time(),
+            "runs": runs,
+        },
+        args.output,
+        indent=2,
+    )
+    args.output.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,5 +1,10 @@
+import concurrent.futures
+import ctypes
 import lzma
+import os
 import pathlib
+import re
+import struct
 import subprocess
 import time
 
@@ -41,15 +46,23 @@ def elm_ec_image_file(elm_ec_image, tmp_path):
     return out_file
 
 
-def mounted_image(program_path, image_path, tmp_path):
+@pytest.fixture(
+    params=[[], ["-o", "lowlevel"], ["-o", "lazy"], ["-o", "lowlevel,lazy"]],
+    ids=["highlevel", "lowlevel", "lazy", "lowlevel-lazy"],
+)
+def mount_options(request):
+    return request.param
+
+
+def mounted_image(program_path, image_path, tmp_path, options=(), ready="raw"):
     mountpoint = tmp_path / "mnt"
     mountpoint.mkdir()
     proc = subprocess.Popen(
-        [program_path, "-f", image_path, mountpoint],
+        [program_path, "-f", *options, image_path, mountpoint],
     )
     try:
         timeout = 5.0
-        while not (mountpoint / "raw").exists() and timeout > 0:
+        while not (mountpoint / ready).exists() and timeout > 0:
             time.sleep(0.2)
             timeout -= 0.2
         yield mountpoint
@@ -71,13 +84,38 @@ def mounted_image(program_path, image_path, tmp_path):
 
 
 @pytest.fixture
-def mounted_elm_ap(elm_ap_image_file, program_path, tmp_path, llvm_coverage):
-    yield from mounted_image(program_path, elm_ap_image_file, tmp_path)
+def mounted_elm_ap(
+    elm_ap_image_file, program_path, tmp_path, mount_options, llvm_coverage
+):
+    yield from mounted_image(
+        program_path, elm_ap_image_file, tmp_path, mount_options
+    )
 
 
 @pytest.fixture
-def mounted_elm_ec(elm_ec_image_file, program_path, tmp_path, llvm_coverage):
-    yield from mounted_image(program_path, elm_ec_image_file, tmp_path)
+def mounted_elm_ec(
+    elm_ec_image_file, program_path, tmp_path, mount_options, llvm_coverage
+):
+    yield from mounted_image(
+        program_path, elm_ec_image_file, tmp_path, mount_options
+    )
+
+
+@pytest.fixture(scope="session")
+def fmapgen_path(program_path):
+    return program_path.parent / "fmapgen"
+
+
+@pytest.fixture
+def mounted_synthetic(
+    fmapgen_path, program_path, tmp_path, mount_options, llvm_coverage
+):
+    image = tmp_path / "synthetic.bin"
+    subprocess.run(
+        [fmapgen_path, "-s", "64M", "-n", "3000", "-d", "2", "-gvc", image],
+        check=True,
+    )
+    yield from mounted_image(program_path, image, tmp_path, mount_options)
 
 
 def test_smoke_ap(mounted_elm_ap):
@@ -102,6 +140,23 @@ def test_file_not_found(mounted_elm_ec):
     assert not path.exists()
 
 
+def test_open_access_mode(mounted_elm_ap):
+    fmapfs_dir = mounted_elm_ap / ".fmapfs"
+
+    # stats can only be read, reset only written
+    for mode in ["r+b", "wb"]:
+        with pytest.raises(PermissionError):
+            open(fmapfs_dir / "stats", mode)
+    for mode in ["rb", "r+b"]:
+        with pytest.raises(PermissionError):
+            open(fmapfs_dir / "reset", mode)
+
+    with open(fmapfs_dir / "stats", "rb") as f:
+        assert f.read()
+    with open(fmapfs_dir / "reset", "wb") as f:
+        f.write(b"1")
+
+
 def test_fmap_name(mounted_elm_ap):
     assert (mounted_elm_ap / "name").read_text() == "FMAP\n"
 
@@ -137,6 +192,108 @@ def test_fmap_regions(mounted_elm_ap):
     assert AP_REGIONS == regions_from_fs
 
 
+def test_synthetic_scale(mounted_synthetic):
+    _, _, areas = parse_fmap((mounted_synthetic / "raw").read_bytes())
+    assert len(areas) == 3205
+    assert sorted(os.listdir(mounted_synthetic / "areas")) == sorted(areas)
+
+    raw = mounted_synthetic / "areas" / "AREA_02999" / "raw"
+    assert raw.stat().st_size == areas["AREA_02999"][1]
+    hwid = mounted_synthetic / "areas" / "GBB" / "gbb-data" / "hwid"
+    assert hwid.read_text() == "SYNTHETIC TEST 0000\n"
+
+
+def test_lookup_regions(mounted_elm_ap):
+    for region in AP_REGIONS:
+        assert (mounted_elm_ap / "areas" / region / "raw").is_file()
+
+    # Prefixes and extensions of real names must not match
+    for name in ["RW_SECTION", "RW_SECTION_AB", "GB", "GBBB", "gbb"]:
+        assert not (mounted_elm_ap / "areas" / name).exists()
+    assert not (mounted_elm_ap / "areas" / "GBB" / "raw" / "x").exists()
+
+
+def parse_fmap(image):
+    # Like fmap_scan(), prefer the most aligned signature
+    offset = max(
+        (m.start() for m in re.finditer(b"__FMAP__", image)),
+        key=lambda o: (o & -o) if o else len(image),
+    )
+    header = struct.Struct("<8sBBQI32sH")
+    area = struct.Struct("<II32sH")
+    *_, nareas = header.unpack_from(image, offset)
+    areas = {}
+    for i in range(nareas):
+        area_offset, size, name, flags = area.unpack_from(
+            image, offset + header.size + i * area.size
+        )
+        areas[name.rstrip(b"\0").decode("utf-8")] = (area_offset, size)
+    return offset, header.size + nareas * area.size, areas
+
+
+@pytest.fixture
+def mounted_odd_size(program_path, tmp_path, mount_options, llvm_coverage):
+    # An odd-sized image with the FMAP at an unaligned offset, after a
+    # stray signature that isn't followed by a valid header
+    image = bytearray(b"\xff" * (3 << 20 | 123))
+    image[0x100:0x108] = b"__FMAP__"
+    fmap = struct.pack("<8sBBQI32sH", b"__FMAP__", 1, 1, 0, len(image), b"ODD", 2)
+    fmap += struct.pack("<II32sH", 0x12340, 0x1000, b"FMAP", 0)
+    fmap += struct.pack("<II32sH", 0x200000, 0x1000, b"DATA", 0)
+    image[0x12340 : 0x12340 + len(fmap)] = fmap
+    image[0x200000:0x201000] = b"\x5a" * 0x1000
+    image_path = tmp_path / "odd.bin"
+    image_path.write_bytes(image)
+    yield from mounted_image(program_path, image_path, tmp_path, mount_options)
+
+
+@pytest.mark.parametrize(
+    "mount_options", [[], ["-o", "backend=pread"]], ids=["mmap", "pread"]
+)
+def test_fmap_scan_odd_size(mounted_odd_size):
+    assert (mounted_odd_size / "name").read_text() == "ODD\n"
+    assert sorted(os.listdir(mounted_odd_size / "areas")) == ["DATA", "FMAP"]
+    data = mounted_odd_size / "areas" / "DATA" / "raw"
+    assert data.read_bytes() == b"\x5a" * 0x1000
+
+
+def test_raw_read_matches_image(mounted_elm_ap, elm_ap_image):
+    fmap_offset, fmap_size, areas = parse_fmap(elm_ap_image)
+    assert (mounted_elm_ap / "raw").read_bytes() == elm_ap_image[
+        fmap_offset : fmap_offset + fmap_size
+    ]
+    for name, (offset, size) in areas.items():
+        raw_file = mounted_elm_ap / "areas" / name / "raw"
+        assert raw_file.read_bytes() == elm_ap_image[offset : offset + size]
+
+
+def test_raw_read_offset(mounted_elm_ap, elm_ap_image):
+    _, _, areas = parse_fmap(elm_ap_image)
+    offset, size = areas["COREBOOT"]
+    with open(mounted_elm_ap / "areas" / "COREBOOT" / "raw", "rb") as f:
+        f.seek(size - 100)
+        assert f.read(4096) == elm_ap_image[offset + size - 100 : offset + size]
+
+
+def test_listing_sizes(mounted_elm_ap, elm_ap_image):
+    _, _, areas = parse_fmap(elm_ap_image)
+    for _ in range(2):
+        for entry in os.scandir(mounted_elm_ap / "areas"):
+            raw = next(e for e in os.scandir(entry.path) if e.name == "raw")
+            assert raw.stat().st_size == areas[entry.name][1]
+    assert (mounted_elm_ap / "version").stat().st_size == len("1.0\n")
+
+
+def test_raw_write_large(mounted_elm_ap, elm_ap_image, elm_ap_image_file):
+    _, _, areas = parse_fmap(elm_ap_image)
+    offset, size = areas["COREBOOT"]
+    data = bytes(range(256)) * (size // 256)
+    raw_file = mounted_elm_ap / "areas" / "COREBOOT" / "raw"
+    raw_file.write_bytes(data)
+    assert raw_file.read_bytes() == data
+    assert elm_ap_image_file.read_bytes()[offset : offset + size] == data
+
+
 def test_raw_write_empty(mounted_elm_ap):
     raw_file = mounted_elm_ap / "areas" / "RO_FRID" / "raw"
     orig_data = raw_file.read_bytes()
@@ -234,8 +391,427 @@ def test_gbb_flags_get(mounted_elm_ap):
     assert read_gbb(mounted_elm_ap) == 0x2B9
 
 
+@pytest.mark.parametrize("mount_options", [["-o", "lowlevel"]], ids=["lowlevel"])
+def test_lowlevel_inodes(mounted_elm_ap):
+    inodes = set()
+    for entry in os.scandir(mounted_elm_ap / "areas"):
+        assert entry.inode() == entry.stat().st_ino
+        inodes.add(entry.inode())
+    assert len(inodes) == len(AP_REGIONS)
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [
+        ["-o", "cache_timeout=0,nokeep_cache,max_write=4096,max_background=4"],
+        ["-o", "lowlevel,cache_timeout=0.5,keep_cache,max_write=8192"],
+    ],
+    ids=["highlevel", "lowlevel"],
+)
+def test_tuning_options(mounted_elm_ap):
+    raw_file = mounted_elm_ap / "areas" / "RW_SHARED" / "raw"
+    data = bytes(range(256)) * (raw_file.stat().st_size // 256)
+    raw_file.write_bytes(data)
+    assert raw_file.read_bytes() == data
+
+
+def wait_for(predicate, timeout=2.0):
+    # Cache invalidation is asynchronous
+    while not predicate() and timeout > 0:
+        time.sleep(0.05)
+        timeout -= 0.05
+    return predicate()
+
+
+def test_invalidate_aliased_data(mounted_elm_ap):
+    gbb_raw = mounted_elm_ap / "areas" / "GBB" / "raw"
+    flags_dir = mounted_elm_ap / "areas" / "GBB" / "gbb-data" / "flags"
+    before = gbb_raw.read_bytes()
+    (flags_dir / "running-faft").write_text("1")
+    assert wait_for(lambda: gbb_raw.read_bytes()[13] == before[13] | 0x01)
+
+
+def test_invalidate_aliased_attrs(mounted_elm_ap):
+    name_file = mounted_elm_ap / "name"
+    assert name_file.stat().st_size == len("FMAP\n")
+    with open(mounted_elm_ap / "raw", "r+b") as f:
+        f.seek(22)
+        f.write(b"NEWNAME\0")
+    assert wait_for(lambda: name_file.stat().st_size == len("NEWNAME\n"))
+    assert name_file.read_text() == "NEWNAME\n"
+
+
+def test_rendered_flag_follows_raw(mounted_elm_ap):
+    flag = mounted_elm_ap / "areas" / "GBB" / "gbb-data" / "flags" / "running-faft"
+    for _ in range(3):
+        assert flag.read_text() == "0\n"
+    with open(mounted_elm_ap / "areas" / "GBB" / "raw", "r+b") as f:
+        f.seek(13)
+        value = f.read(1)[0]
+        f.seek(13)
+        f.write(bytes([value | 0x01]))
+    assert wait_for(lambda: flag.read_text() == "1\n")
+
+
 def test_gbb_flags_set(mounted_elm_ap):
     flags_dir = mounted_elm_ap / "areas" / "GBB" / "gbb-data" / "flags"
     (flags_dir / "running-faft").write_text("1")
     (flags_dir / "disable-ec-software-sync").write_text("0\n")
     assert read_gbb(mounted_elm_ap) == 0x1B9
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [["-o", "max_idle_threads=8"], ["-o", "lowlevel,max_idle_threads=8"]],
+    ids=["highlevel", "lowlevel"],
+)
+def test_gbb_flags_concurrent(mounted_elm_ap):
+    flags_dir = mounted_elm_ap / "areas" / "GBB" / "gbb-data" / "flags"
+    # These flags all share the first byte of the GBB flags
+    names = [name for name, bit in GBB_BITS.items() if bit < 8]
+
+    def toggle(name):
+        for i in range(50):
+            (flags_dir / name).write_text(str(i % 2))
+        (flags_dir / name).write_text("1")
+
+    with concurrent.futures.ThreadPoolExecutor(len(names)) as pool:
+        list(pool.map(toggle, names))
+
+    assert read_gbb(mounted_elm_ap) == 0x2B9 | 0xFF
+
+
+def read_stats(mountpoint):
+    stats = {}
+    for line in (mountpoint / ".fmapfs" / "stats").read_text().splitlines():
+        if not line.startswith("#"):
+            op, ops, nbytes, errors, p50, p99, hist = line.split()
+            stats[op] = (int(ops), int(nbytes), int(errors))
+    return stats
+
+
+def test_stats(mounted_elm_ap):
+    data = (mounted_elm_ap / "areas" / "RO_FRID" / "raw").read_bytes()
+    stats = read_stats(mounted_elm_ap)
+    assert len(stats) == 20
+    reads = stats["file_read"][0] + stats["file_read_buf"][0]
+    assert reads > 0
+
+    (mounted_elm_ap / ".fmapfs" / "reset").write_text("1")
+    stats = read_stats(mounted_elm_ap)
+    assert stats["file_read_buf"] == (0, 0, 0)
+    assert stats["file_read"][0] <= 2
+
+
+@pytest.mark.parametrize(
+    "mount_options", [[], ["-o", "lazy"]], ids=["highlevel", "lazy"]
+)
+def test_stats_path_index(mounted_elm_ap):
+    # Lazy areas are populated, and their files indexed, on first lookup
+    for region in AP_REGIONS:
+        assert (mounted_elm_ap / "areas" / region / "raw").is_file()
+
+    before = read_stats(mounted_elm_ap)
+    for region in AP_REGIONS:
+        assert (mounted_elm_ap / "areas" / region / "ro").is_file()
+    assert not (mounted_elm_ap / "areas" / "NOT_AN_AREA").exists()
+    after = read_stats(mounted_elm_ap)
+
+    hits = after["path_index_hit"][0] - before["path_index_hit"][0]
+    misses = after["path_index_miss"][0] - before["path_index_miss"][0]
+    assert hits >= len(AP_REGIONS)
+    assert misses >= 1
+
+
+def test_stats_snapshot_per_open(mounted_elm_ap):
+    stats_path = mounted_elm_ap / ".fmapfs" / "stats"
+    raw = mounted_elm_ap / "areas" / "RO_FRID" / "raw"
+    with open(stats_path, "rb", buffering=0) as f:
+        first = f.read(16)
+
+        # Other readers take their own snapshots in between
+        for _ in range(4):
+            raw.read_bytes()
+            read_stats(mounted_elm_ap)
+        text = (first + f.read()).decode()
+
+    lines = [line for line in text.splitlines() if not line.startswith("#")]
+    assert len(lines) == 20
+    assert all(len(line.split()) == 7 for line in lines)
+    reads = {line.split()[0]: int(line.split()[1]) for line in lines}
+    assert reads["file_read"] < read_stats(mounted_elm_ap)["file_read"][0]
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [["-o", "trace=64"], ["-o", "lowlevel,trace=64"]],
+    ids=["highlevel", "lowlevel"],
+)
+def test_trace(mounted_elm_ap):
+    raw = mounted_elm_ap / "areas" / "RO_FRID" / "raw"
+    data = raw.read_bytes()
+    with open(raw, "r+b", buffering=0) as f:
+        f.seek(4)
+        f.write(data[4:8])
+
+    events = []
+    for line in (mounted_elm_ap / ".fmapfs" / "trace").read_text().splitlines():
+        if not line.startswith("#"):
+            time_ns, thread, op, ino, offset, size, result, latency = line.split()
+            events.append((op.split("_")[0], int(offset), int(size), int(result)))
+
+    assert any(op == "read" and result > 0 for op, _, _, result in events)
+    assert ("write", 4, 4, 4) in events
+
+
+@pytest.fixture
+def mounted_multi(elm_ap_image, elm_ec_image, program_path, tmp_path, llvm_coverage):
+    images = tmp_path / "images"
+    images.mkdir()
+    (images / "ap.bin").write_bytes(elm_ap_image)
+    (images / "ec.bin").write_bytes(elm_ec_image)
+    (images / "subdir").mkdir()
+    yield from mounted_image(
+        program_path, images, tmp_path, ["-o", "max_images=1"], ready="ap.bin"
+    )
+
+
+def test_multi_image(mounted_multi, elm_ap_image, elm_ec_image, tmp_path):
+    assert sorted(os.listdir(mounted_multi)) == ["ap.bin", "ec.bin"]
+    assert (mounted_multi / "ap.bin").is_dir()
+    assert not (mounted_multi / "subdir").exists()
+    assert not (mounted_multi / "missing.bin").exists()
+
+    # With one image loaded at a time, each access evicts the other
+    ap_raw = mounted_multi / "ap.bin" / "areas" / "RO_FRID" / "raw"
+    for _ in range(2):
+        for name, image in [("ap.bin", elm_ap_image), ("ec.bin", elm_ec_image)]:
+            _, _, areas = parse_fmap(image)
+            for area, (offset, size) in areas.items():
+                raw = mounted_multi / name / "areas" / area / "raw"
+                assert raw.stat().st_size == size
+            offset, size = areas["RO_FRID"]
+            raw = mounted_multi / name / "areas" / "RO_FRID" / "raw"
+            assert raw.read_bytes() == image[offset : offset + size]
+
+    # Open files pin their image, and writes outlive its eviction
+    offset, _ = parse_fmap(elm_ap_image)[2]["RO_FRID"]
+    with open(ap_raw, "r+b") as f:
+        assert (mounted_multi / "ec.bin" / "version").read_text() == "1.0\n"
+        f.write(b"\xde\xad\xbe\xef")
+        f.flush()
+        assert (mounted_multi / "ec.bin" / "name").is_file()
+    assert (mounted_multi / "ec.bin" / "version").read_text() == "1.0\n"
+    data = (tmp_path / "images" / "ap.bin").read_bytes()
+    assert data[offset : offset + 4] == b"\xde\xad\xbe\xef"
+    assert ap_raw.read_bytes()[:4] == b"\xde\xad\xbe\xef"
+
+
+def io_uring_supported():
+    # io_uring_setup(1, params), which sandboxes and old kernels refuse
+    libc = ctypes.CDLL(None, use_errno=True)
+    params = ctypes.create_string_buffer(120)
+    fd = libc.syscall(425, 1, params)
+    if fd < 0:
+        return False
+    os.close(fd)
+    return True
+
+
+@pytest.fixture
+def backend_supported(mount_options, program_path, tmp_path):
+    options = ",".join(mount_options)
+    if "backend=direct" in options:
+        try:
+            os.close(os.open(tmp_path / "direct", os.O_CREAT | os.O_DIRECT))
+        except OSError:
+            pytest.skip("O_DIRECT is not supported by the test filesystem")
+    if "backend=uring" in options:
+        usage = subprocess.run([program_path, "--help"], capture_output=True)
+        if b"uring" not in usage.stderr:
+            pytest.skip("Built without io_uring support")
+        if not io_uring_supported():
+            pytest.skip("io_uring is not available")
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [
+        ["-o", "backend=pread"],
+        ["-o", "lowlevel,backend=pread"],
+        ["-o", "backend=direct"],
+        ["-o", "backend=uring"],
+        ["-o", "lowlevel,backend=uring,max_idle_threads=8"],
+    ],
+    ids=["pread", "lowlevel-pread", "direct", "uring", "lowlevel-uring"],
+)
+def test_image_backends(
+    backend_supported, mounted_elm_ap, elm_ap_image, elm_ap_image_file
+):
+    fmap_offset, fmap_size, areas = parse_fmap(elm_ap_image)
+    assert (mounted_elm_ap / "raw").read_bytes() == elm_ap_image[
+        fmap_offset : fmap_offset + fmap_size
+    ]
+    offset, size = areas["COREBOOT"]
+    raw = mounted_elm_ap / "areas" / "COREBOOT" / "raw"
+    assert raw.read_bytes() == elm_ap_image[offset : offset + size]
+
+    # Writes smaller than a block, at odd offsets, reach the image
+    with open(raw, "r+b", buffering=0) as f:
+        f.seek(4097)
+        f.write(b"\xde\xad\xbe\xef")
+    data = elm_ap_image_file.read_bytes()
+    assert data[offset + 4097 : offset + 4101] == b"\xde\xad\xbe\xef"
+    assert data[offset + 4101 : offset + size] == elm_ap_image[
+        offset + 4101 : offset + size
+    ]
+
+    (mounted_elm_ap / "version").write_text("1.1")
+    assert (mounted_elm_ap / "version").read_text() == "1.1\n"
+    hwid = mounted_elm_ap / "areas" / "GBB" / "gbb-data" / "hwid"
+    hwid.write_text("ELM TEST\n")
+    assert hwid.read_text() == "ELM TEST\n"
+    assert b"ELM TEST\0" in elm_ap_image_file.read_bytes()
+
+    # Concurrent reads share the backend, and io_uring batches them
+    def read_area(item):
+        name, (offset, size) = item
+        raw = mounted_elm_ap / "areas" / name / "raw"
+        return raw.read_bytes() == data[offset : offset + size]
+
+    data = elm_ap_image_file.read_bytes()
+    with concurrent.futures.ThreadPoolExecutor(8) as pool:
+        assert all(pool.map(read_area, list(areas.items()) * 4))
+
+
+def flushed_runs(mountpoint):
+    ops, nbytes, errors = read_stats(mountpoint)["flush_run"]
+    assert errors == 0
+    return ops, nbytes
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [
+        ["-o", "flush=write"],
+        ["-o", "flush=close,backend=pread"],
+        ["-o", "flush=interval,flush_interval=0.1"],
+        ["-o", "lowlevel,flush=fsync,backend=pread"],
+        ["-o", "flush=fsync,backend=direct"],
+    ],
+    ids=["write", "close-pread", "interval", "lowlevel-fsync-pread", "direct"],
+)
+def test_flush_policies(
+    backend_supported,
+    mounted_elm_ap,
+    elm_ap_image,
+    elm_ap_image_file,
+    mount_options,
+):
+    policy = mount_options[1].split("flush=")[1].split(",")[0]
+    _, _, areas = parse_fmap(elm_ap_image)
+    offset, _ = areas["RW_VPD"]
+    raw = mounted_elm_ap / "areas" / "RW_VPD" / "raw"
+
+    # Dirty pages on both sides of a clean one, written back as two runs
+    with open(raw, "r+b", buffering=0) as f:
+        f.write(b"\x11" * 16)
+        f.seek(8192)
+        f.write(b"\x22" * 16)
+
+        if policy == "write":
+            assert flushed_runs(mounted_elm_ap) == (2, 8192)
+        elif policy == "interval":
+            timeout = 5.0
+            while flushed_runs(mounted_elm_ap) != (2, 8192) and timeout > 0:
+                time.sleep(0.1)
+                timeout -= 0.1
+            assert flushed_runs(mounted_elm_ap) == (2, 8192)
+        else:
+            assert flushed_runs(mounted_elm_ap) == (0, 0)
+
+        if policy == "fsync":
+            os.fsync(f.fileno())
+            assert flushed_runs(mounted_elm_ap) == (2, 8192)
+
+    # With flush=close, closing wrote them back; otherwise they already were
+    assert flushed_runs(mounted_elm_ap) == (2, 8192)
+
+    data = elm_ap_image_file.read_bytes()
+    assert data[offset : offset + 16] == b"\x11" * 16
+    assert data[offset + 16 : offset + 8192] == elm_ap_image[
+        offset + 16 : offset + 8192
+    ]
+    assert data[offset + 8192 : offset + 8208] == b"\x22" * 16
+
+    # An fsync with nothing dirty has nothing to write back
+    with open(raw, "rb") as f:
+        os.fsync(f.fileno())
+    assert flushed_runs(mounted_elm_ap) == (2, 8192)
+    if "lowlevel" not in mount_options[1]:
+        assert read_stats(mounted_elm_ap)["fsync"][0] >= 1
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [
+        ["-o", "flush=interval,flush_interval=3600"],
+        ["-o", "lowlevel,flush=interval,flush_interval=3600"],
+    ],
+    ids=["highlevel", "lowlevel"],
+)
+def test_flush_on_close_of_written_files(mounted_elm_ap):
+    raw = mounted_elm_ap / "areas" / "RW_VPD" / "raw"
+    with open(raw, "r+b", buffering=0) as f:
+        f.write(b"\x11" * 16)
+
+        # Files only read from have nothing of their own to write back
+        for _ in range(3):
+            raw.read_bytes()
+        assert flushed_runs(mounted_elm_ap) == (0, 0)
+
+    # Closing the written one starts writeback of its page
+    assert flushed_runs(mounted_elm_ap) == (1, 4096)
+
+
+@pytest.mark.parametrize(
+    "mount_options",
+    [[], ["-o", "lowlevel,erase_size=65536"]],
+    ids=["4k", "lowlevel-64k"],
+)
+def test_changes(mounted_elm_ap, elm_ap_image, mount_options):
+    erase_size = 65536 if mount_options else 4096
+    changes = mounted_elm_ap / ".fmapfs" / "changes"
+    assert (changes / "areas").read_text() == ""
+    assert (changes / "layout").read_text() == ""
+    assert not any((changes / "bitmap").read_bytes())
+
+    _, _, areas = parse_fmap(elm_ap_image)
+    offset, _ = areas["RW_VPD"]
+    with open(mounted_elm_ap / "areas" / "RW_VPD" / "raw", "r+b") as f:
+        f.seek(4096)
+        f.write(b"\x11" * 8192)
+
+    # Whole erase blocks around the written bytes
+    start = (offset + 4096) // erase_size * erase_size
+    end = -(-(offset + 4096 + 8192) // erase_size) * erase_size - 1
+    name = f"changed_{start:08x}"
+    assert (changes / "layout").read_text() == f"{start:08x}:{end:08x} {name}\n"
+    assert (changes / "include").read_text() == f"-i {name}\n"
+    assert "RW_VPD" in (changes / "areas").read_text().split()
+    assert "RW_LEGACY" not in (changes / "areas").read_text().split()
+
+    bitmap = (changes / "bitmap").read_bytes()
+    assert len(bitmap) == -(-len(elm_ap_image) // erase_size // 8)
+    blocks = [i for i in range(len(bitmap) * 8) if bitmap[i // 8] >> i % 8 & 1]
+    assert blocks == list(range(start // erase_size, end // erase_size + 1))
+
+    # Areas are named as in the FMAP in the image, even once rewritten
+    index = list(areas).index("RW_VPD")
+    with open(mounted_elm_ap / "raw", "r+b") as f:
+        f.seek(56 + index * 42 + 8)
+        f.write(b"RW_VPX\0")
+    changed = (changes / "areas").read_text().split()
+    assert "RW_VPX" in changed
+    assert "RW_VPD" not in changed
+    assert "FMAP" in changed
@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+
+#include "arena.h"
+#include "log.h"
+#include "route.h"
+#include "snapshot_file.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Every thread records into its own ring of fixed-size binary events, so
+ * tracing takes no locks and shares no cache lines with other threads.
+ * Only the owner writes a ring: it fills the slot, then publishes the new
+ * head.  Dumpers copy the slots, then reread the head and drop the events
+ * that the owner may have overwritten in the meantime.
+ *
+ * Rings of exited threads are kept for the next thread to start, so the
+ * worker churn of the libfuse loop doesn't grow memory, and the events of
+ * retired workers stay visible until they are overwritten.
+ */
+
+struct trace_event {
+	uint64_t time_ns;
+	uint64_t offset;
+	uint32_t ino;
+	uint32_t size;
+	int32_t result;
+	uint32_t latency_ns;
+	uint16_t op;
+};
+
+struct trace_ring {
+	/* Number of events ever written, the slot is head % trace_entries */
+	uint64_t head;
+	unsigned int id;
+	struct trace_ring *next;
+	struct trace_ring *next_free;
+	struct trace_event events[];
+};
+
+unsigned int trace_entries;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static struct trace_ring *trace_rings;
+static struct trace_ring *trace_free;
+static unsigned int trace_n_rings;
+static __thread struct trace_ring *trace_self;
+
+static const char *const trace_op_names[STATS_N_OPS] = {
+	[STATS_FILE_GET_SIZE] = "get_size",
+	[STATS_FILE_READ] = "read",
+	[STATS_FILE_READ_BUF] = "read_buf",
+	[STATS_FILE_WRITE] = "write",
+	[STATS_FILE_WRITE_BUF] = "write_buf",
+};
+
+void trace_enable(unsigned int entries)
+{
+	/* Round up to a power of two, so slots are a mask away */
+	while (entries & (entries - 1))
+		entries += entries & -entries;
+
+	trace_entries = entries;
+}
+
+static void trace_thread_exit(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	pthread_mutex_lock(&trace_lock);
+	ring->next_free = trace_free;
+	trace_free = ring;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_init_key(void)
+{
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring = trace_self;
+	size_t events_size = trace_entries * sizeof(ring->events[0]);
+
+	if (ring)
+		return ring;
+
+	pthread_once(&trace_once, trace_init_key);
+
+	pthread_mutex_lock(&trace_lock);
+	ring = trace_free;
+	if (ring) {
+		trace_free = ring->next_free;
+	} else {
+		ring = calloc(1, sizeof(*ring) + events_size);
+		if (ring) {
+			ring->id = trace_n_rings++;
+			ring->next = trace_rings;
+			trace_rings = ring;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (ring)
+		pthread_setspecific(trace_key, ring);
+
+	trace_self = ring;
+	return ring;
+}
+
+void trace_push(enum stats_op op, uint64_t ino, off_t offset, size_t size,
+		uint64_t start, int64_t rv)
+{
+	struct trace_ring *ring = trace_ring_get();
+	struct trace_event *event;
+	uint64_t head;
+
+	if (!ring)
+		return;
+
+	head = ring->head;
+	event = &ring->events[head & (trace_entries - 1)];
+	event->time_ns = start;
+	event->offset = offset;
+	event->ino = ino;
+	event->size = size;
+	event->result = rv;
+	event->latency_ns = stats_start() - start;
+	event->op = op;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+struct trace_dump_event {
+	unsigned int ring;
+	struct trace_event event;
+};
+
+static int trace_cmp(const void *a, const void *b)
+{
+	const struct trace_dump_event *ea = a;
+	const struct trace_dump_event *eb = b;
+
+	if (ea->event.time_ns != eb->event.time_ns)
+		return ea->event.time_ns < eb->event.time_ns ? -1 : 1;
+
+	return 0;
+}
+
+/* Copy out the events still in ring, returning how many were copied */
+static size_t trace_copy_ring(struct trace_ring *ring,
+			      struct trace_dump_event *out)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > trace_entries ? head - trace_entries : 0;
+	uint64_t valid;
+	size_t n = 0;
+
+	for (uint64_t i = first; i < head; i++) {
+		out[n].ring = ring->id;
+		memcpy(&out[n].event, &ring->events[i & (trace_entries - 1)],
+		       sizeof(out[n].event));
+		n++;
+	}
+
+	/*
+	 * The owner may have moved on while we copied.  Every event it
+	 * published since, and the one it may be writing now, overwrote
+	 * one of ours from the start.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	valid = head + 1 > trace_entries ? head + 1 - trace_entries : 0;
+	if (valid <= first)
+		return n;
+	if (valid - first >= n)
+		return 0;
+
+	n -= valid - first;
+	memmove(out, out + (valid - first), n * sizeof(*out));
+	return n;
+}
+
+/* Print every ring's events, oldest first, to out */
+static int trace_print(FILE *out)
+{
+	struct trace_dump_event *events;
+	size_t n = 0;
+
+	fprintf(out, "# time_ns thread op ino offset size result "
+		     "latency_ns\n");
+	if (!trace_entries)
+		return 0;
+
+	pthread_mutex_lock(&trace_lock);
+	events = malloc((size_t)trace_n_rings * trace_entries *
+			sizeof(*events));
+	if (!events) {
+		pthread_mutex_unlock(&trace_lock);
+		return -ENOMEM;
+	}
+	for (struct trace_ring *ring = trace_rings; ring; ring = ring->next)
+		n += trace_copy_ring(ring, events + n);
+	pthread_mutex_unlock(&trace_lock);
+
+	qsort(events, n, sizeof(*events), trace_cmp);
+	for (size_t i = 0; i < n; i++) {
+		struct trace_event *e = &events[i].event;
+		const char *name = trace_op_names[e->op];
+
+		fprintf(out,
+			"%" PRIu64 " %u %s %" PRIu32 " %" PRIu64 " %" PRIu32
+			" %" PRId32 " %" PRIu32 "\n",
+			e->time_ns, events[i].ring, name ? name : "?", e->ino,
+			e->offset, e->size, e->result, e->latency_ns);
+	}
+
+	free(events);
+	return 0;
+}
+
+/*
+ * SIGUSR1 only posts a semaphore, which is async-signal-safe.  The dump
+ * itself happens on a thread of its own.
+ */
+static sem_t trace_sem;
+static pthread_t trace_dumper;
+static bool trace_running;
+static bool trace_stopping;
+static struct sigaction trace_old_action;
+
+static void trace_signal(int sig)
+{
+	sem_post(&trace_sem);
+}
+
+static void *trace_dump_thread(void *arg)
+{
+	for (;;) {
+		while (sem_wait(&trace_sem) < 0 && errno == EINTR)
+			;
+		if (__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		trace_print(stderr);
+		fflush(stderr);
+	}
+
+	return NULL;
+}
+
+int trace_start(void)
+{
+	struct sigaction action = {
+		.sa_handler = trace_signal,
+		.sa_flags = SA_RESTART,
+	};
+	int rv;
+
+	if (!trace_entries || trace_running)
+		return 0;
+
+	sem_init(&trace_sem, 0, 0);
+	trace_stopping = false;
+	rv = pthread_create(&trace_dumper, NULL, trace_dump_thread, NULL);
+	if (rv) {
+		fmapfs_log(FUSE_LOG_ERR, "Unable to start trace thread: %s",
+			   strerror(rv));
+		sem_destroy(&trace_sem);
+		return -1;
+	}
+
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, &trace_old_action);
+	trace_running = true;
+
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if (!trace_running)
+		return;
+
+	sigaction(SIGUSR1, &trace_old_action, NULL);
+
+	__atomic_store_n(&trace_stopping, true, __ATOMIC_RELEASE);
+	sem_post(&trace_sem);
+	pthread_join(trace_dumper, NULL);
+	sem_destroy(&trace_sem);
+	trace_running = false;
+}
+
+static int trace_print_file(FILE *out, void *param)
+{
+	return trace_print(out);
+}
+
+void add_trace_file(struct arena *arena, struct directory *basedir)
+{
+	add_snapshot_file(arena, basedir, "trace", trace_print_file, NULL);
+}
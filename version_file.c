@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,63 +6,83 @@
 
 #include <fmap.h>
 #include <fuse.h>
-#include <fuse_log.h>
 
 #include "arena.h"
+#include "image.h"
+#include "rendered_file.h"
 #include "route.h"
 #include "version_file.h"
 
-static int version_read(char *buf, size_t n_bytes, off_t offset,
-			struct fuse_file_info *fi, void *fmap_in)
-{
-	struct fmap *fmap = fmap_in;
-	size_t ver_len;
-	char ver_buf[9] = { 0 };
-
-	fuse_log(FUSE_LOG_DEBUG, "read %zu bytes, at offset %zu", n_bytes,
-		 offset);
+struct version_priv {
+	struct image *image;
+	off_t image_offset;
+};
 
-	snprintf(ver_buf, sizeof(ver_buf), "%hhu.%hhu\n", fmap->ver_major,
-		 fmap->ver_minor);
-	ver_len = strlen(ver_buf);
+static size_t version_render(char *buf, size_t size, void *priv_in)
+{
+	struct version_priv *priv = priv_in;
+	uint8_t ver[2];
 
-	if (offset >= ver_len)
+	if (image_read(priv->image, ver, sizeof(ver), priv->image_offset) < 0)
 		return 0;
 
-	if (n_bytes + offset >= ver_len) {
-		n_bytes = ver_len - offset;
-		fuse_log(FUSE_LOG_DEBUG, "adjust n_bytes to %zu", n_bytes);
-	}
-
-	memcpy(buf, ver_buf + offset, n_bytes);
-	return n_bytes;
+	return snprintf(buf, size, "%hhu.%hhu\n", ver[0], ver[1]);
 }
 
 static int version_write(const char *buf, size_t n_bytes, off_t offset,
-			 struct fuse_file_info *fi, void *fmap_in)
+			 struct fuse_file_info *fi, void *priv_in)
 {
-	struct fmap *fmap = fmap_in;
+	struct version_priv *priv = priv_in;
 	char ver_buf[16] = { 0 };
+	uint8_t ver[2];
+	ssize_t rv;
 
-	version_read(ver_buf, sizeof(ver_buf), 0, fi, fmap);
+	version_render(ver_buf, sizeof(ver_buf), priv);
 	if (offset >= sizeof(ver_buf) - 1)
 		return 0;
 	if (n_bytes + offset >= sizeof(ver_buf) - 1)
 		n_bytes = sizeof(ver_buf) - offset - 1;
 
+	rv = image_read(priv->image, ver, sizeof(ver), priv->image_offset);
+	if (rv < 0)
+		return rv;
+
+	/* Fields the edit leaves unparseable keep their value */
 	memcpy(ver_buf + offset, buf, n_bytes);
-	sscanf(ver_buf, "%hhu.%hhu", &fmap->ver_major, &fmap->ver_minor);
+	sscanf(ver_buf, "%hhu.%hhu", &ver[0], &ver[1]);
+
+	rv = image_write(priv->image, ver, sizeof(ver), priv->image_offset);
+	if (rv < 0)
+		return rv;
 
 	return n_bytes;
 }
 
-static struct file_ops ops = {
-	.read = version_read,
+static void version_get_extent(void *priv_in, struct file_extent *extent)
+{
+	struct version_priv *priv = priv_in;
+
+	/* ver_major and ver_minor are adjacent */
+	extent->offset = priv->image_offset;
+	extent->size = 2;
+	extent->linear = false;
+}
+
+static const struct render_ops ops = {
+	.render = version_render,
 	.write = version_write,
+	.get_extent = version_get_extent,
 };
 
 void add_version_file(struct arena *arena, struct directory *basedir,
-		      const char *name, struct fmap *fmap)
+		      const char *name, struct image *image, off_t image_offset)
 {
-	route_new_file(arena, basedir, name, &ops, fmap);
+	struct version_priv *priv =
+		arena_malloc(arena, sizeof(struct version_priv), 1);
+
+	priv->image = image;
+	priv->image_offset = image_offset;
+
+	/* "255.255\n" */
+	add_rendered_file(arena, basedir, name, &ops, priv, 9);
 }
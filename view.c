@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "arena.h"
+#include "log.h"
+#include "route.h"
+#include "view.h"
+
+/*
+ * Several files render the same image bytes (the GBB flags, the GBB
+ * raw file, the region containing the GBB, ...).  The view map records
+ * which bytes each file renders, so a write through one file can
+ * invalidate the kernel's cache of every other file showing those bytes.
+ *
+ * Invalidation is handed to a notifier thread: the kernel may be holding
+ * locks on the invalidated file while waiting on us for another request,
+ * so notifying from within a request could deadlock.
+ */
+
+static uint64_t view_lock_mask(size_t start, size_t end)
+{
+	size_t first = start >> VIEW_LOCK_CHUNK_SHIFT;
+	size_t last = (end - 1) >> VIEW_LOCK_CHUNK_SHIFT;
+	uint64_t mask = 0;
+
+	if (last - first + 1 >= VIEW_LOCK_STRIPES)
+		return ~(uint64_t)0;
+
+	for (size_t chunk = first; chunk <= last; chunk++)
+		mask |= (uint64_t)1 << (chunk % VIEW_LOCK_STRIPES);
+
+	return mask;
+}
+
+bool view_image_range(struct view *view, off_t offset, size_t n_bytes,
+		      size_t *start, size_t *end)
+{
+	size_t size;
+
+	if (!view || !n_bytes)
+		return false;
+
+	if (!view->linear) {
+		*start = view->start;
+		*end = view->end;
+		return true;
+	}
+
+	size = view->end - view->start;
+	if (offset < 0 || (size_t)offset >= size)
+		return false;
+	if (n_bytes > size - offset)
+		n_bytes = size - offset;
+
+	*start = view->start + offset;
+	*end = *start + n_bytes;
+	return true;
+}
+
+/*
+ * Lock the image bytes behind n_bytes of the file at offset: only those
+ * for a linear view, all the view renders otherwise.  Stripes are always
+ * taken in ascending order, so overlapping views can't deadlock.  Files
+ * without a view have nothing to lock.  Returns the stripes taken, for
+ * view_unlock().
+ */
+uint64_t view_lock(struct view *view, off_t offset, size_t n_bytes,
+		   bool write)
+{
+	uint64_t mask;
+	size_t start;
+	size_t end;
+
+	if (!view)
+		return 0;
+
+	if (!view->linear)
+		mask = view->lock_mask;
+	else if (view_image_range(view, offset, n_bytes, &start, &end))
+		mask = view_lock_mask(start, end);
+	else
+		return 0;
+
+	for (int i = 0; i < VIEW_LOCK_STRIPES; i++) {
+		if (!(mask & ((uint64_t)1 << i)))
+			continue;
+
+		if (write)
+			pthread_rwlock_wrlock(&view->map->stripes[i]);
+		else
+			pthread_rwlock_rdlock(&view->map->stripes[i]);
+	}
+
+	return mask;
+}
+
+void view_unlock(struct view *view, uint64_t mask)
+{
+	if (!view)
+		return;
+
+	for (int i = VIEW_LOCK_STRIPES - 1; i >= 0; i--) {
+		if (mask & ((uint64_t)1 << i))
+			pthread_rwlock_unlock(&view->map->stripes[i]);
+	}
+}
+
+static int view_cmp(const void *a, const void *b)
+{
+	const struct view *va = *(const struct view **)a;
+	const struct view *vb = *(const struct view **)b;
+
+	if (va->start != vb->start)
+		return va->start < vb->start ? -1 : 1;
+	return 0;
+}
+
+void view_map_init(struct view_map *map, size_t image_size)
+{
+	pthread_mutex_init(&map->lock, NULL);
+	pthread_cond_init(&map->cond, NULL);
+	for (int i = 0; i < VIEW_LOCK_STRIPES; i++)
+		pthread_rwlock_init(&map->stripes[i], NULL);
+
+	map->image_size = image_size;
+	map->path_prefix = NULL;
+	map->views = NULL;
+	map->n_views = 0;
+	map->capacity = 0;
+	map->max_view_size = 0;
+}
+
+/*
+ * Give every file among entries that renders image bytes a view.  Called
+ * once with the whole tree, and again with the entries of each lazily
+ * populated directory, serialized by the caller since it allocates from
+ * the arena.  Writers may be looking at the map meanwhile.
+ */
+void view_map_add(struct view_map *map, struct arena *arena,
+		  struct directory_entry **entries, size_t n_entries)
+{
+	struct view **added;
+	struct view **views = map->views;
+	size_t n_added = 0;
+	size_t i, j, k;
+
+	added = arena_calloc(arena, sizeof(*added), n_entries ?: 1);
+
+	for (i = 0; i < n_entries; i++) {
+		struct directory_entry *entry = entries[i];
+		struct file_extent extent = { 0 };
+		struct view *view;
+
+		if (!S_ISREG(entry->mode) || !entry->reg_file.ops->get_extent)
+			continue;
+
+		entry->reg_file.ops->get_extent(entry->reg_file.param, &extent);
+		if (!extent.size || extent.offset < 0 ||
+		    extent.offset + extent.size > map->image_size)
+			continue;
+
+		view = arena_calloc(arena, sizeof(*view), 1);
+		view->start = extent.offset;
+		view->end = view->start + extent.size;
+		view->linear = extent.linear;
+		view->entry = entry;
+		view->map = map;
+		view->lock_mask = view_lock_mask(view->start, view->end);
+		entry->reg_file.view = view;
+		added[n_added++] = view;
+	}
+
+	if (!n_added)
+		return;
+
+	qsort(added, n_added, sizeof(*added), view_cmp);
+
+	/* Grow by doubling, so populating every directory stays O(n) */
+	if (map->n_views + n_added > map->capacity) {
+		size_t capacity = map->capacity * 2;
+
+		if (capacity < map->n_views + n_added)
+			capacity = map->n_views + n_added;
+		views = arena_calloc(arena, sizeof(*views), capacity);
+		map->capacity = capacity;
+	}
+
+	pthread_mutex_lock(&map->lock);
+
+	/* Merge from the back, so views can be merged in place */
+	i = map->n_views;
+	j = n_added;
+	k = i + j;
+	while (j) {
+		if (i && map->views[i - 1]->start > added[j - 1]->start)
+			views[--k] = map->views[--i];
+		else
+			views[--k] = added[--j];
+	}
+	if (views != map->views) {
+		if (i)
+			memcpy(views, map->views, i * sizeof(*views));
+		map->views = views;
+	}
+	map->n_views += n_added;
+
+	for (j = 0; j < n_added; j++) {
+		size_t size = added[j]->end - added[j]->start;
+
+		if (size > map->max_view_size)
+			map->max_view_size = size;
+	}
+
+	pthread_mutex_unlock(&map->lock);
+}
+
+/* Index of the first view which could overlap image offset start */
+static size_t view_map_first(struct view_map *map, size_t start)
+{
+	size_t lo = 0;
+	size_t hi = map->n_views;
+	size_t min_start = 0;
+
+	if (start > map->max_view_size)
+		min_start = start - map->max_view_size;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (map->views[mid]->start < min_start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void view_queue(struct view_map *map, struct view *view,
+		       off_t start, off_t end)
+{
+	if (view->pending) {
+		if (start < view->pending_start)
+			view->pending_start = start;
+		if (end > view->pending_end)
+			view->pending_end = end;
+		return;
+	}
+
+	view->pending = true;
+	view->pending_start = start;
+	view->pending_end = end;
+	view->next_pending = map->pending;
+	map->pending = view;
+}
+
+/*
+ * Called after n_bytes were written at offset through entry.  Every view
+ * of the written image bytes gets a new generation and drops its cached
+ * size, and is queued for invalidation in the kernel, except the written
+ * file itself when its page cache already holds exactly what was written.
+ */
+void view_map_written(struct view_map *map, struct directory_entry *entry,
+		      off_t offset, size_t n_bytes)
+{
+	struct view *src = entry->reg_file.view;
+	size_t start;
+	size_t end;
+
+	route_invalidate_stat(entry);
+
+	if (!view_image_range(src, offset, n_bytes, &start, &end))
+		return;
+
+	pthread_mutex_lock(&map->lock);
+	for (size_t i = view_map_first(map, start);
+	     i < map->n_views && map->views[i]->start < end; i++) {
+		struct view *view = map->views[i];
+
+		if (view->end <= start)
+			continue;
+
+		route_invalidate_stat(view->entry);
+		__atomic_fetch_add(&view->generation, 1, __ATOMIC_RELEASE);
+
+		if (!map->running || (view == src && view->linear))
+			continue;
+
+		if (view->linear) {
+			size_t lo = start > view->start ? start : view->start;
+			size_t hi = end < view->end ? end : view->end;
+
+			view_queue(map, view, lo - view->start,
+				   hi - view->start);
+		} else {
+			view_queue(map, view, 0, 0);
+		}
+	}
+
+	if (map->running)
+		pthread_cond_signal(&map->cond);
+	pthread_mutex_unlock(&map->lock);
+}
+
+static void view_notify(struct view_map *map, struct directory_entry *entry,
+			off_t start, off_t end)
+{
+	char path[PATH_MAX];
+	int len = 0;
+	int rv;
+
+	if (map->se) {
+		/* A length of zero invalidates through the end of the file */
+		rv = fuse_lowlevel_notify_inval_inode(map->se, entry->ino,
+						      start, end - start);
+	} else {
+		if (map->path_prefix)
+			len = snprintf(path, sizeof(path), "%s",
+				       map->path_prefix);
+		if (len >= sizeof(path) ||
+		    route_get_path(entry, path + len, sizeof(path) - len) < 0)
+			return;
+		rv = fuse_invalidate_path(map->fuse, path);
+	}
+
+	/* -ENOENT just means the kernel has nothing cached */
+	if (rv < 0 && rv != -ENOENT)
+		fmapfs_log(FUSE_LOG_DEBUG, "Failed to invalidate %s: %s",
+			   entry->name, strerror(-rv));
+}
+
+static void *view_notifier(void *arg)
+{
+	struct view_map *map = arg;
+
+	pthread_mutex_lock(&map->lock);
+	while (true) {
+		struct view *view;
+		off_t start;
+		off_t end;
+
+		while (!map->pending && !map->stopping)
+			pthread_cond_wait(&map->cond, &map->lock);
+
+		/* Nothing is cached once the session is going away */
+		if (map->stopping)
+			break;
+
+		view = map->pending;
+		map->pending = view->next_pending;
+		view->pending = false;
+		start = view->pending_start;
+		end = view->pending_end;
+
+		pthread_mutex_unlock(&map->lock);
+		view_notify(map, view->entry, start, end);
+		pthread_mutex_lock(&map->lock);
+	}
+	pthread_mutex_unlock(&map->lock);
+
+	return NULL;
+}
+
+int view_map_start(struct view_map *map)
+{
+	int rv;
+
+	pthread_mutex_lock(&map->lock);
+	map->stopping = false;
+	rv = pthread_create(&map->notifier, NULL, view_notifier, map);
+	if (rv)
+		fmapfs_log(FUSE_LOG_ERR, "Unable to start notifier thread: %s",
+			   strerror(rv));
+	else
+		map->running = true;
+	pthread_mutex_unlock(&map->lock);
+
+	return rv ? -1 : 0;
+}
+
+void view_map_stop(struct view_map *map)
+{
+	pthread_mutex_lock(&map->lock);
+	if (!map->running) {
+		pthread_mutex_unlock(&map->lock);
+		return;
+	}
+	map->running = false;
+	map->stopping = true;
+	pthread_cond_signal(&map->cond);
+	pthread_mutex_unlock(&map->lock);
+
+	pthread_join(map->notifier, NULL);
+}